@@ -31,17 +31,23 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xdamage.h>
+#include <X11/extensions/XShm.h>
 
 #include <GL/gl.h>
 #include <GL/glx.h>
 
 #include <region.h>
 
-typedef struct _CompPlugin  CompPlugin;
-typedef struct _CompDisplay CompDisplay;
-typedef struct _CompScreen  CompScreen;
-typedef struct _CompWindow  CompWindow;
-typedef struct _CompTexture CompTexture;
+typedef struct _CompPlugin    CompPlugin;
+typedef struct _CompDisplay   CompDisplay;
+typedef struct _CompScreen    CompScreen;
+typedef struct _CompWindow    CompWindow;
+typedef struct _CompWindowSlab CompWindowSlab;
+typedef struct _CompTexture   CompTexture;
+typedef struct _CompImage     CompImage;
+typedef struct _CompImageLoad CompImageLoad;
+typedef struct _CompCapture   CompCapture;
+typedef struct _CompFileSink  CompFileSink;
 
 /* virtual modifiers */
 
@@ -131,6 +137,59 @@ readPng (const char   *filename,
 	 unsigned int *height);
 
 
+/* worker.c */
+
+typedef void (*WorkProc) (void *closure);
+
+typedef int CompWorkHandle;
+
+CompWorkHandle
+compAddWork (WorkProc work,
+	     WorkProc done,
+	     void     *closure);
+
+void
+compRemoveWork (CompWorkHandle handle);
+
+int
+compWorkFd (void);
+
+void
+compProcessFinishedWork (void);
+
+
+/* capture.c */
+
+/* data holds the pixels of each rectangle after those of the one
+   before it, as native 32 bit ARGB in rows as wide as the rectangle
+   from the bottom row up */
+typedef void (*CaptureFrameProc) (CompScreen *screen,
+				  const char *data,
+				  BoxPtr     rects,
+				  int	     nRects,
+				  void	     *closure);
+
+CompCapture *
+addScreenCapture (CompScreen	   *screen,
+		  CaptureFrameProc proc,
+		  void		   *closure);
+
+void
+removeScreenCapture (CompScreen  *screen,
+		     CompCapture *capture);
+
+void
+captureScreen (CompScreen *screen,
+	       Region	  region);
+
+Bool
+setScreenCaptureFile (CompScreen *screen,
+		      const char *fileName);
+
+void
+flushScreenCaptures (CompScreen *screen);
+
+
 /* option.c */
 
 typedef enum {
@@ -293,6 +352,8 @@ struct _CompDisplay {
     Bool shapeExtension;
     int  shapeEvent, shapeError;
 
+    Bool shmExtension;
+
     Atom winTypeAtom;
     Atom winDesktopAtom;
     Atom winDockAtom;
@@ -303,6 +364,7 @@ struct _CompDisplay {
     Atom winDialogAtom;
     Atom winNormalAtom;
     Atom winOpacityAtom;
+    Atom winOpaqueRegionAtom;
     Atom winActiveAtom;
 
     Atom wmStateAtom;
@@ -311,6 +373,7 @@ struct _CompDisplay {
     Atom xBackgroundAtom[2];
 
     GLenum textureFilter;
+    Bool   textureMipmap;
 
     unsigned int modMask[CompModNum];
 
@@ -369,6 +432,10 @@ CompWindow *
 findWindowAtDisplay (CompDisplay *display,
 		     Window      id);
 
+CompWindow *
+findClientWindowAtDisplay (CompDisplay *display,
+			   Window      id);
+
 unsigned int
 virtualToRealModMask (CompDisplay  *d,
 		      unsigned int modMask);
@@ -495,6 +562,9 @@ preparePaintScreen (CompScreen *screen,
 void
 donePaintScreen (CompScreen *screen);
 
+void
+prepareXCoords (CompScreen *screen);
+
 void
 paintTransformedScreen (CompScreen		*screen,
 			const ScreenPaintAttrib *sAttrib,
@@ -512,10 +582,6 @@ Bool
 moreWindowVertices (CompWindow *w,
 		    int        newSize);
 
-Bool
-moreWindowIndices (CompWindow *w,
-		   int        newSize);
-
 void
 addWindowGeometry (CompWindow *w,
 		   CompMatrix *matrix,
@@ -544,7 +610,11 @@ paintBackground (CompScreen   *screen,
 
 typedef enum {
     COMP_TEXTURE_FILTER_FAST,
-    COMP_TEXTURE_FILTER_GOOD
+    COMP_TEXTURE_FILTER_GOOD,
+
+    /* good filtering with mipmaps when the display filter is "Best",
+       used for textures drawn smaller than their real size */
+    COMP_TEXTURE_FILTER_BEST
 } CompTextureFilter;
 
 struct _CompTexture {
@@ -554,6 +624,22 @@ struct _CompTexture {
     GLXPixmap	      pixmap;
     CompTextureFilter filter;
     CompMatrix        matrix;
+    int		      width, height;
+
+    /* shared texture loaded from an image file */
+    CompImage	      *image;
+
+    /* used when pixmap contents are copied instead of bound */
+    Region	      damage;
+    XShmSegmentInfo   shmInfo;
+    int		      depth;
+    GLenum	      format;
+    GLenum	      type;
+    Bool	      swapBytes;
+
+    /* mipmapped copy of the texture, created on demand */
+    GLuint	      mipmap;
+    Bool	      mipmapDamaged;
 };
 
 void
@@ -583,6 +669,10 @@ void
 releasePixmapFromTexture (CompScreen  *screen,
 			  CompTexture *texture);
 
+void
+updatePixmapTexture (CompScreen  *screen,
+		     CompTexture *texture);
+
 void
 enableTexture (CompScreen        *screen,
 	       CompTexture	 *texture,
@@ -591,11 +681,48 @@ enableTexture (CompScreen        *screen,
 void
 disableTexture (CompTexture *texture);
 
+void
+releaseTextureMipmap (CompScreen  *screen,
+		      CompTexture *texture);
+
+/* decode procs run on the worker thread and must not use X or GL,
+   pixel data is returned in the same format as readPng */
+typedef Bool (*DecodeImageProc) (void	      *closure,
+				 char	      **data,
+				 unsigned int *width,
+				 unsigned int *height);
+
+/* texture is NULL if decoding failed, otherwise the callee takes
+   ownership of the texture by copying it */
+typedef void (*ImageLoadedProc) (CompScreen   *screen,
+				 CompTexture  *texture,
+				 unsigned int width,
+				 unsigned int height,
+				 void	      *closure);
+
+CompImageLoad *
+startImageLoad (CompScreen	*screen,
+		DecodeImageProc decode,
+		ImageLoadedProc loaded,
+		void		*closure);
+
+void
+cancelImageLoad (CompScreen    *screen,
+		 CompImageLoad *load);
+
+Bool
+uploadImages (CompScreen *screen);
+
 
 /* screen.c */
 
-#define COMP_SCREEN_OPTION_REFRESH_RATE 0
-#define COMP_SCREEN_OPTION_NUM          1
+#define COMP_SCREEN_OPTION_REFRESH_RATE         0
+#define COMP_SCREEN_OPTION_PREBIND_WINDOWS      1
+#define COMP_SCREEN_OPTION_TEXTURE_MEMORY_LIMIT 2
+#define COMP_SCREEN_OPTION_TEXTURE_MEMORY       3
+#define COMP_SCREEN_OPTION_CAPTURE_FILE         4
+#define COMP_SCREEN_OPTION_PAINTED_PIXELS       5
+#define COMP_SCREEN_OPTION_NUM                  6
 
 typedef void (*FuncPtr) (void);
 typedef FuncPtr (*GLXGetProcAddressProc) (const GLubyte *procName);
@@ -608,6 +735,22 @@ typedef FuncPtr (*GLXGetProcAddressProc) (const GLubyte *procName);
 #define GLX_FRONT_LEFT_EXT                  0x6005
 #endif
 
+/* GLX_EXT_texture_from_pixmap tokens, some of them have the same names
+   as the render texture tokens above but different values */
+#define TFP_BIND_TO_TEXTURE_RGB     0x20D0
+#define TFP_BIND_TO_TEXTURE_RGBA    0x20D1
+#define TFP_BIND_TO_TEXTURE_TARGETS 0x20D3
+#define TFP_Y_INVERTED		    0x20D4
+#define TFP_TEXTURE_FORMAT	    0x20D5
+#define TFP_TEXTURE_TARGET	    0x20D6
+#define TFP_TEXTURE_FORMAT_RGB	    0x20D9
+#define TFP_TEXTURE_FORMAT_RGBA	    0x20DA
+#define TFP_TEXTURE_2D		    0x20DC
+#define TFP_TEXTURE_RECTANGLE	    0x20DD
+#define TFP_FRONT_LEFT		    0x20DE
+#define TFP_TEXTURE_2D_BIT	    0x00000002
+#define TFP_TEXTURE_RECTANGLE_BIT   0x00000004
+
 typedef Bool    (*GLXBindTexImageMesaProc)(Display	 *display,
 					   GLXDrawable	 drawable,
 					   int		 buffer);
@@ -626,9 +769,43 @@ typedef Bool    (*GLXQueryDrawableProc)   (Display	 *display,
 typedef void (*GLActiveTextureProc) (GLenum texture);
 typedef void (*GLClientActiveTextureProc) (GLenum texture);
 
+typedef void (*GLGenerateMipmapProc) (GLenum target);
+typedef void (*GLGenFramebuffersProc) (GLsizei n,
+				       GLuint  *framebuffers);
+typedef void (*GLBindFramebufferProc) (GLenum target,
+				       GLuint framebuffer);
+typedef void (*GLFramebufferTexture2DProc) (GLenum target,
+					    GLenum attachment,
+					    GLenum textarget,
+					    GLuint texture,
+					    GLint  level);
+typedef GLenum (*GLCheckFramebufferStatusProc) (GLenum target);
+
+typedef void (*GLGenBuffersProc) (GLsizei n,
+				  GLuint  *buffers);
+typedef void (*GLDeleteBuffersProc) (GLsizei	  n,
+				     const GLuint *buffers);
+typedef void (*GLBindBufferProc) (GLenum target,
+				  GLuint buffer);
+typedef void (*GLBufferDataProc) (GLenum     target,
+				  GLsizeiptr size,
+				  const void *data,
+				  GLenum     usage);
+typedef void *(*GLMapBufferProc) (GLenum target,
+				  GLenum access);
+typedef GLboolean (*GLUnmapBufferProc) (GLenum target);
+
 
 #define MAX_DEPTH 32
 
+/* GLX 1.3 config used for binding pixmaps of one depth */
+typedef struct _CompFBConfig {
+    GLXFBConfig fbConfig;
+    int		textureFormat;
+    int		textureTargets;
+    int		yInverted;
+} CompFBConfig;
+
 typedef CompOption *(*GetScreenOptionsProc) (CompScreen *screen,
 					     int	*count);
 typedef Bool (*SetScreenOptionProc) (CompScreen      *screen,
@@ -682,6 +859,12 @@ struct _CompScreen {
     char *windowPrivateIndices;
     int  windowPrivateLen;
 
+    /* privates allocated with a size are laid out in one block that
+       is stored with each window */
+    int  *windowPrivateSizes;
+    int  *windowPrivateOffsets;
+    int  windowPrivateBlockSize;
+
     Colormap	      colormap;
     int		      screenNum;
     int		      width;
@@ -694,17 +877,47 @@ struct _CompScreen {
     XWindowAttributes attrib;
     Window	      grabWindow;
     XVisualInfo       *glxPixmapVisuals[MAX_DEPTH + 1];
+    CompFBConfig      glxPixmapFBConfigs[MAX_DEPTH + 1];
+    Bool	      useFBConfigs;
     int		      textureRectangle;
     int		      textureNonPowerOfTwo;
     int		      textureEnvCombine;
+    int		      fbo;
+    GLuint	      mipmapFbo;
+    int		      pbo;
+    Bool	      textureFromPixmap;
     int		      maxTextureUnits;
     Cursor	      invisibleCursor;
     XRectangle        *exposeRects;
     int		      sizeExpose;
     int		      nExpose;
     CompTexture       backgroundTexture;
-    unsigned int      pendingDestroys;
+    CompWindow	      *pendingDestroys;
     int		      desktopWindowCount;
+    CompWindowSlab    *windowSlabs;
+
+    /* stacking order, bottom to top */
+    CompWindow	      **stack;
+    int		      nStack;
+
+    /* viewable windows in stacking order, windows unmapped since
+       the last call to updateMappedWindows may still be present */
+    CompWindow	      **mapped;
+    int		      nMapped;
+    Bool	      pendingUnmaps;
+    Bool	      pendingBinds;
+
+    unsigned long     textureMemory;
+    unsigned int      frameCount;
+    unsigned long long paintedPixels;
+
+    CompImage	      *images;
+    CompImageLoad     *imageLoads;
+    CompImageLoad     *backgroundLoad;
+    CompCapture	      *captures;
+    CompFileSink      *fileSink;
+
+    int		      stackSize;
     KeyCode	      escapeKeyCode;
 
     CompButtonGrab *buttonGrab;
@@ -735,6 +948,19 @@ struct _CompScreen {
     GLActiveTextureProc       activeTexture;
     GLClientActiveTextureProc clientActiveTexture;
 
+    GLGenerateMipmapProc	 generateMipmap;
+    GLGenFramebuffersProc	 genFramebuffers;
+    GLBindFramebufferProc	 bindFramebuffer;
+    GLFramebufferTexture2DProc	 framebufferTexture2D;
+    GLCheckFramebufferStatusProc checkFramebufferStatus;
+
+    GLGenBuffersProc    genBuffers;
+    GLDeleteBuffersProc deleteBuffers;
+    GLBindBufferProc    bindBuffer;
+    GLBufferDataProc    bufferData;
+    GLMapBufferProc     mapBuffer;
+    GLUnmapBufferProc   unmapBuffer;
+
     GLXContext ctx;
 
     CompOption opt[COMP_SCREEN_OPTION_NUM];
@@ -799,6 +1025,13 @@ void
 unhookWindowFromScreen (CompScreen *s,
 			CompWindow *w);
 
+void
+insertMappedWindow (CompScreen *s,
+		    CompWindow *w);
+
+void
+updateMappedWindows (CompScreen *s);
+
 CompWindow *
 findWindowAtScreen (CompScreen *s,
 		    Window     id);
@@ -838,6 +1071,9 @@ updatePassiveGrabs (CompScreen *s);
      (w)->attrib.x >= (w)->screen->width || \
      (w)->attrib.y >= (w)->screen->height)
 
+/* number of window privates that fit without a separate allocation */
+#define WINDOW_INLINE_PRIVATES 8
+
 typedef Bool (*InitPluginForWindowProc) (CompPlugin *plugin,
 					 CompWindow *window);
 typedef void (*FiniPluginForWindowProc) (CompPlugin *plugin,
@@ -861,25 +1097,49 @@ struct _CompWindow {
     GLint	      height;
     Region	      region;
     Region	      clip;
+    Region	      opaque;
     Atom	      type;
     Bool	      invisible;
     GLushort	      opacity;
     Bool	      destroyed;
     Bool	      damaged;
+    Bool	      pluginsInitialized;
+    CompWindow	      *nextDestroy;
+    unsigned long     textureMemory;
+    unsigned int      lastPaint;
+
+    /* the window has been resized, its new pixmap is bound once the
+       window has been damaged and the old one is stretched until then */
+    Bool	      resized;
+    Bool	      resizeDamaged;
 
     GLfloat  *vertices;
     int      vertexSize;
-    GLushort *indices;
-    int      indexSize;
     int      vCount;
     int      texUnits;
 
+    /* set by plugins that move vertices away from the window's
+       rectangle in addWindowGeometry */
+    Bool deformed;
+
     CompPrivate *privates;
+    CompPrivate privateStorage[WINDOW_INLINE_PRIVATES];
+
+    CompWindowSlab *slab;
+    char	   *privateBlock;
+    int		   privateBlockSize;
 };
 
 int
 allocateWindowPrivateIndex (CompScreen *screen);
 
+/* like allocateWindowPrivateIndex but the private of each window
+   points to size bytes of zeroed storage owned by the window, they
+   are valid before the plugin's window init and must not be freed */
+int
+allocateSizedWindowPrivateIndex (CompScreen *screen,
+				 int	    size);
+
 void
 freeWindowPrivateIndex (CompScreen *screen,
 			int	   index);
@@ -900,6 +1160,9 @@ getWindowOpacity (CompDisplay *display,
 void
 updateWindowRegion (CompWindow *w);
 
+void
+updateWindowOpaqueRegion (CompWindow *w);
+
 void
 addWindow (CompScreen *screen,
 	   Window     id,
@@ -923,6 +1186,15 @@ bindWindow (CompWindow *w);
 void
 releaseWindow (CompWindow *w);
 
+void
+updateWindowTextureMemory (CompWindow *w);
+
+void
+prebindWindows (CompScreen *s);
+
+void
+evictWindowTextures (CompScreen *s);
+
 void
 configureWindow (CompWindow	 *w,
 		 XConfigureEvent *ce);
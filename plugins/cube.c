@@ -34,7 +34,7 @@
 #include <sys/time.h>
 
 #ifdef USE_LIBSVG_CAIRO
-#include <cairo-xlib.h>
+#include <cairo.h>
 #include <svg-cairo.h>
 #endif
 
@@ -57,6 +57,14 @@ typedef struct _CubeDisplay {
     HandleEventProc handleEvent;
 } CubeDisplay;
 
+#ifdef USE_LIBSVG_CAIRO
+typedef struct _CubeSvg {
+    char     *fileName;
+    int	     width, height;
+    GLushort color[3];
+} CubeSvg;
+#endif
+
 #define CUBE_SCREEN_OPTION_COLOR 0
 #define CUBE_SCREEN_OPTION_SVGS  1
 #define CUBE_SCREEN_OPTION_NEXT  2
@@ -74,12 +82,11 @@ typedef struct _CubeScreen {
     GLushort color[3];
     GLfloat  tc[8];
 
-    Pixmap	    pixmap;
     CompTexture     texture;
 
 #ifdef USE_LIBSVG_CAIRO
-    cairo_t	    *cr;
-    svg_cairo_t	    *svgc;
+    CubeSvg	    *svg;
+    CompImageLoad   *svgLoad;
     int		    svgNFile;
     int		    svgCurFile;
     CompOptionValue *svgFiles;
@@ -108,9 +115,8 @@ cubeInitSvg (CompScreen *s)
 {
     CUBE_SCREEN (s);
 
-    cs->pixmap = None;
-    cs->cr = 0;
-    cs->svgc = 0;
+    cs->svg     = 0;
+    cs->svgLoad = 0;
 }
 
 static void
@@ -119,108 +125,196 @@ cubeFiniSvg (CompScreen *s)
 {
     CUBE_SCREEN (s);
 
-    if (cs->svgc)
-	svg_cairo_destroy (cs->svgc);
+    if (cs->svgLoad)
+    {
+	cancelImageLoad (s, cs->svgLoad);
+	free (cs->svg);
+    }
+}
+
+/* runs on the worker thread */
+static Bool
+cubeDecodeSvg (void	    *closure,
+	       char	    **data,
+	       unsigned int *returnWidth,
+	       unsigned int *returnHeight)
+{
+    CubeSvg	    *svg = closure;
+    svg_cairo_t	    *svgc;
+    cairo_surface_t *surface;
+    cairo_t	    *cr;
+    char	    *buffer;
+    int		    width, height;
+
+    if (svg_cairo_create (&svgc))
+    {
+	fprintf (stderr, "%s: Failed to create svg_cairo_t.\n",
+		 programName);
+	return FALSE;
+    }
+
+    svg_cairo_set_viewport_dimension (svgc, svg->width, svg->height);
+
+    if (svg_cairo_parse (svgc, svg->fileName))
+    {
+	fprintf (stderr, "%s: Failed to load svg: %s.\n",
+		 programName, svg->fileName);
+	svg_cairo_destroy (svgc);
+	return FALSE;
+    }
+
+    buffer = malloc (svg->width * svg->height * 4);
+    if (!buffer)
+    {
+	svg_cairo_destroy (svgc);
+	return FALSE;
+    }
+
+    svg_cairo_get_size (svgc, &width, &height);
+
+    surface = cairo_image_surface_create_for_data ((unsigned char *) buffer,
+						   CAIRO_FORMAT_RGB24,
+						   svg->width, svg->height,
+						   svg->width * 4);
+    cr = cairo_create (surface);
+    cairo_surface_destroy (surface);
+
+    cairo_set_source_rgb (cr,
+			  (double) svg->color[0] / 0xffff,
+			  (double) svg->color[1] / 0xffff,
+			  (double) svg->color[2] / 0xffff);
+    cairo_rectangle (cr, 0, 0, svg->width, svg->height);
+    cairo_fill (cr);
+
+    cairo_scale (cr,
+		 (double) svg->width / width,
+		 (double) svg->height / height);
+
+    svg_cairo_render (svgc, cr);
 
-    if (cs->cr)
-	cairo_destroy (cs->cr);
+    cairo_destroy (cr);
+    svg_cairo_destroy (svgc);
 
-    if (cs->pixmap)
-	XFreePixmap (s->display->display, cs->pixmap);
+    *data	  = buffer;
+    *returnWidth  = svg->width;
+    *returnHeight = svg->height;
+
+    return TRUE;
 }
 
 static void
-cubeLoadSvg (CompScreen *s,
-	     int	n)
+cubeStartSvgLoad (CompScreen *s);
+
+static void
+cubeSvgLoaded (CompScreen   *s,
+	       CompTexture  *texture,
+	       unsigned int width,
+	       unsigned int height,
+	       void	    *closure)
 {
-    int width, height;
+    CubeSvg *svg = closure;
+    Bool    current;
 
     CUBE_SCREEN (s);
 
-    if (!cs->svgNFile)
+    current = (cs->svgNFile &&
+	       strcmp (svg->fileName, cs->svgFiles[cs->svgCurFile].s) == 0);
+
+    free (svg);
+
+    cs->svg     = 0;
+    cs->svgLoad = 0;
+
+    /* another slide was selected while this one was rendered */
+    if (!current)
     {
-	finiTexture (s, &cs->texture);
-	initTexture (s, &cs->texture);
-	cubeFiniSvg (s);
-	cubeInitSvg (s);
+	if (texture)
+	    finiTexture (s, texture);
+
+	if (cs->svgNFile)
+	    cubeStartSvgLoad (s);
+
 	return;
     }
 
-    if (!cs->pixmap)
-    {
-	cairo_surface_t *surface;
-	Visual		*visual;
-	int		depth;
+    if (!texture)
+	return;
 
-	depth = DefaultDepth (s->display->display, s->screenNum);
-	cs->pixmap = XCreatePixmap (s->display->display, s->root,
-				    s->width, s->height,
-				    depth);
+    finiTexture (s, &cs->texture);
+    cs->texture = *texture;
 
-	if (!bindPixmapToTexture (s, &cs->texture, cs->pixmap,
-				  s->width, s->height, depth))
-	{
-	    fprintf (stderr, "%s: Couldn't bind slide pixmap 0x%x to "
-		     "texture\n", programName, (int) cs->pixmap);
-	}
+    /* the top row of the rendered slide is at t = 0 */
+    switch (cs->texture.target) {
+    case GL_TEXTURE_RECTANGLE_ARB:
+	cs->tc[2] = cs->tc[4] = width;
+	cs->tc[1] = cs->tc[3] = height;
+	break;
+    case GL_TEXTURE_2D:
+    default:
+	cs->tc[2] = cs->tc[4] = 1.0f;
+	cs->tc[1] = cs->tc[3] = 1.0f;
+	break;
+    }
 
-	switch (cs->texture.target) {
-	case GL_TEXTURE_RECTANGLE_ARB:
-	    cs->tc[2] = cs->tc[4] = s->width;
-	    cs->tc[5] = cs->tc[7] = s->height;
-	    break;
-	case GL_TEXTURE_2D:
-	default:
-	    cs->tc[2] = cs->tc[4] = 1.0f;
-	    cs->tc[5] = cs->tc[7] = 1.0f;
-	    break;
-	}
+    cs->tc[5] = cs->tc[7] = 0.0f;
 
-	visual = DefaultVisual (s->display->display, s->screenNum);
-	surface = cairo_xlib_surface_create (s->display->display,
-					     cs->pixmap, visual,
-					     s->width, s->height);
-	cs->cr = cairo_create (surface);
-	cairo_surface_destroy (surface);
-    }
+    damageScreen (s);
+}
 
-    cs->svgCurFile = n % cs->svgNFile;
+static void
+cubeStartSvgLoad (CompScreen *s)
+{
+    CubeSvg *svg;
+    char    *fileName;
 
-    if (cs->svgc)
-	svg_cairo_destroy (cs->svgc);
+    CUBE_SCREEN (s);
 
-    if (svg_cairo_create (&cs->svgc))
-    {
-	fprintf (stderr, "%s: Failed to create svg_cairo_t.\n",
-		 programName);
+    fileName = cs->svgFiles[cs->svgCurFile].s;
+
+    svg = malloc (sizeof (CubeSvg) + strlen (fileName) + 1);
+    if (!svg)
 	return;
-    }
 
-    svg_cairo_set_viewport_dimension (cs->svgc, s->width, s->height);
+    svg->fileName = (char *) (svg + 1);
+    strcpy (svg->fileName, fileName);
 
-    if (svg_cairo_parse (cs->svgc, cs->svgFiles[cs->svgCurFile].s))
+    svg->width  = s->width;
+    svg->height = s->height;
+
+    memcpy (svg->color, cs->color, sizeof (svg->color));
+
+    cs->svgLoad = startImageLoad (s, cubeDecodeSvg, cubeSvgLoaded, svg);
+    if (!cs->svgLoad)
     {
-	fprintf (stderr, "%s: Failed to load svg: %s.\n",
-		 programName, cs->svgFiles[cs->svgCurFile].s);
+	free (svg);
 	return;
     }
 
-    svg_cairo_get_size (cs->svgc, &width, &height);
+    cs->svg = svg;
+}
 
-    cairo_save (cs->cr);
-    cairo_set_source_rgb (cs->cr,
-			  (double) cs->color[0] / 0xffff,
-			  (double) cs->color[1] / 0xffff,
-			  (double) cs->color[2] / 0xffff);
-    cairo_rectangle (cs->cr, 0, 0, s->width, s->height);
-    cairo_fill (cs->cr);
+/* slides are rendered on the worker thread, the current slide is
+   shown until the new one is ready */
+static void
+cubeLoadSvg (CompScreen *s,
+	     int	n)
+{
+    CUBE_SCREEN (s);
 
-    cairo_scale (cs->cr,
-		 (double) s->width / width,
-		 (double) s->height / height);
+    if (!cs->svgNFile)
+    {
+	finiTexture (s, &cs->texture);
+	initTexture (s, &cs->texture);
+	cubeFiniSvg (s);
+	cubeInitSvg (s);
+	return;
+    }
 
-    svg_cairo_render (cs->svgc, cs->cr);
-    cairo_restore (cs->cr);
+    cs->svgCurFile = n % cs->svgNFile;
+
+    /* the pending load restarts itself when it completes */
+    if (!cs->svgLoad)
+	cubeStartSvgLoad (s);
 }
 #endif
 
@@ -336,14 +430,16 @@ cubeTranslateWindows (CompScreen *s,
 		      int	 tx)
 {
     CompWindow *w;
-    int        m, wx;
+    int        i, m, wx;
 
     tx = MOD (tx, s->width * 4);
     if (tx == 0)
 	return;
 
-    for (w = s->windows; w; w = w->next)
+    for (i = 0; i < s->nMapped; i++)
     {
+	w = s->mapped[i];
+
 	if (w->attrib.map_state != IsViewable)
 	    continue;
 
@@ -334,20 +334,26 @@ compareWindows (const void *elem1,
 static Bool
 layoutThumbs (CompScreen *s)
 {
-    CompWindow *w;
-    int	       i, j, y2;
-    int        cx, cy;
-    int        lineLength, itemsPerLine;
-    float      scaleW, scaleH;
-    int        totalWidth, totalHeight;
+    CompWindow   *w;
+    ExposeWindow *ew;
+    int	         i, j, y2;
+    int          cx, cy;
+    int          lineLength, itemsPerLine;
+    float        scaleW, scaleH;
+    int          totalWidth, totalHeight;
 
     EXPOSE_SCREEN (s);
 
     cx = cy = es->nWindows = 0;
 
-    for (w = s->windows; w; w = w->next)
+    for (i = 0; i < s->nStack; i++)
     {
-	EXPOSE_WINDOW (w);
+	w = s->stack[i];
+
+	if (!w->pluginsInitialized)
+	    continue;
+
+	ew = GET_EXPOSE_WINDOW (w, es);
 
 	if (ew->slot)
 	    ew->adjust = TRUE;
@@ -602,13 +608,20 @@ exposePreparePaintScreen (CompScreen *s,
 
     if (es->grabIndex && es->state != EXPOSE_STATE_WAIT)
     {
-	CompWindow *w;
+	CompWindow   *w;
+	ExposeWindow *ew;
+	int	     i;
 
 	es->moreAdjust = 0;
 
-	for (w = s->windows; w; w = w->next)
+	for (i = 0; i < s->nStack; i++)
 	{
-	    EXPOSE_WINDOW (w);
+	    w = s->stack[i];
+
+	    if (!w->pluginsInitialized)
+		continue;
+
+	    ew = GET_EXPOSE_WINDOW (w, es);
 
 	    if (ew->adjust)
 	    {
@@ -662,12 +675,20 @@ exposeCheckForWindowAt (CompScreen *s,
 			int        x,
 			int        y)
 {
-    int        x1, y1, x2, y2;
-    CompWindow *w;
+    int          i, x1, y1, x2, y2;
+    CompWindow   *w;
+    ExposeWindow *ew;
 
-    for (w = s->reverseWindows; w; w = w->prev)
+    EXPOSE_SCREEN (s);
+
+    for (i = s->nMapped - 1; i >= 0; i--)
     {
-	EXPOSE_WINDOW (w);
+	w = s->mapped[i];
+
+	if (!w->pluginsInitialized)
+	    continue;
+
+	ew = GET_EXPOSE_WINDOW (w, es);
 
 	if (ew->slot)
 	{
@@ -710,11 +731,18 @@ exposeTerminate (CompScreen *s)
 
     if (es->grabIndex)
     {
-	CompWindow *w;
+	CompWindow   *w;
+	ExposeWindow *ew;
+	int	     i;
 
-	for (w = s->windows; w; w = w->next)
+	for (i = 0; i < s->nStack; i++)
 	{
-	    EXPOSE_WINDOW (w);
+	    w = s->stack[i];
+
+	    if (!w->pluginsInitialized)
+		continue;
+
+	    ew = GET_EXPOSE_WINDOW (w, es);
 
 	    ew->slot = 0;
 	    ew->adjust = TRUE;
@@ -729,7 +757,14 @@ exposeTerminate (CompScreen *s)
 static Bool
 exposeSelectWindow (CompWindow *w)
 {
-    EXPOSE_WINDOW (w);
+    ExposeWindow *ew;
+
+    EXPOSE_SCREEN (w->screen);
+
+    if (!w->pluginsInitialized)
+	return FALSE;
+
+    ew = GET_EXPOSE_WINDOW (w, es);
 
     if (ew->slot && w->client && w->client != w->screen->activeWindow)
     {
@@ -947,7 +982,8 @@ exposeInitScreen (CompPlugin *p,
     if (!es)
 	return FALSE;
 
-    es->windowPrivateIndex = allocateWindowPrivateIndex (s);
+    es->windowPrivateIndex =
+	allocateSizedWindowPrivateIndex (s, sizeof (ExposeWindow));
     if (es->windowPrivateIndex < 0)
     {
 	free (es);
@@ -1020,9 +1056,7 @@ exposeInitWindow (CompPlugin *p,
 
     EXPOSE_SCREEN (w->screen);
 
-    ew = malloc (sizeof (ExposeWindow));
-    if (!ew)
-	return FALSE;
+    ew = GET_EXPOSE_WINDOW (w, es);
 
     ew->slot = 0;
     ew->scale = 1.0f;
@@ -1030,20 +1064,9 @@ exposeInitWindow (CompPlugin *p,
     ew->adjust = FALSE;
     ew->xVelocity = ew->yVelocity = ew->scaleVelocity = 0.0f;
 
-    w->privates[es->windowPrivateIndex].ptr = ew;
-
     return TRUE;
 }
 
-static void
-exposeFiniWindow (CompPlugin *p,
-		  CompWindow *w)
-{
-    EXPOSE_WINDOW (w);
-
-    free (ew);
-}
-
 static Bool
 exposeInit (CompPlugin *p)
 {
@@ -1072,7 +1095,7 @@ CompPluginVTable exposeVTable = {
     exposeInitScreen,
     exposeFiniScreen,
     exposeInitWindow,
-    exposeFiniWindow,
+    0, /* FiniWindow */
     0, /* GetDisplayOptions */
     0, /* SetDisplayOption */
     exposeGetScreenOptions,
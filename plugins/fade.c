@@ -234,7 +234,7 @@ fadeHandleEvent (CompDisplay *d,
     switch (event->type) {
     case DestroyNotify:
 	w = findWindowAtDisplay (d, event->xdestroywindow.window);
-	if (w)
+	if (w && w->pluginsInitialized)
 	{
 	    FADE_WINDOW (w);
 
@@ -250,7 +250,7 @@ fadeHandleEvent (CompDisplay *d,
 	break;
     case UnmapNotify:
 	w = findWindowAtDisplay (d, event->xunmap.window);
-	if (w)
+	if (w && w->pluginsInitialized)
 	{
 	    FADE_WINDOW (w);
 
@@ -265,7 +265,7 @@ fadeHandleEvent (CompDisplay *d,
 	break;
     case MapNotify:
 	w = findWindowAtDisplay (d, event->xunmap.window);
-	if (w)
+	if (w && w->pluginsInitialized)
 	{
 	    FADE_WINDOW (w);
 
@@ -357,7 +357,8 @@ fadeInitScreen (CompPlugin *p,
     if (!fs)
 	return FALSE;
 
-    fs->windowPrivateIndex = allocateWindowPrivateIndex (s);
+    fs->windowPrivateIndex =
+	allocateSizedWindowPrivateIndex (s, sizeof (FadeWindow));
     if (fs->windowPrivateIndex < 0)
     {
 	free (fs);
@@ -401,28 +402,15 @@ fadeInitWindow (CompPlugin *p,
 
     FADE_SCREEN (w->screen);
 
-    fw = malloc (sizeof (FadeWindow));
-    if (!fw)
-	return FALSE;
+    fw = GET_FADE_WINDOW (w, fs);
 
     fw->opacity   = OPAQUE;
     fw->direction = 0;
     fw->destroyed = 0;
 
-    w->privates[fs->windowPrivateIndex].ptr = fw;
-
     return TRUE;
 }
 
-static void
-fadeFiniWindow (CompPlugin *p,
-		CompWindow *w)
-{
-    FADE_WINDOW (w);
-
-    free (fw);
-}
-
 static Bool
 fadeInit (CompPlugin *p)
 {
@@ -451,7 +439,7 @@ static CompPluginVTable fadeVTable = {
     fadeInitScreen,
     fadeFiniScreen,
     fadeInitWindow,
-    fadeFiniWindow,
+    0, /* FiniWindow */
     0, /* GetDisplayOptions */
     0, /* SetDisplayOption */
     fadeGetScreenOptions,
@@ -384,11 +384,14 @@ rotatePreparePaintScreen (CompScreen *s,
 		if (tx)
 		{
 		    CompWindow *w;
+		    int	       i;
 
 		    tx *= s->width;
 
-		    for (w = s->windows; w; w = w->next)
+		    for (i = 0; i < s->nMapped; i++)
 		    {
+			w = s->mapped[i];
+
 			if (w->attrib.map_state != IsViewable)
 			    continue;
 
@@ -51,36 +51,110 @@
 #define SHADOW_OFFSET_Y_MIN     -50
 #define SHADOW_OFFSET_Y_MAX      50
 
+#define SHADOW_SHAPED_DEFAULT FALSE
+
+#define SHADOW_CACHE_SIZE 8
+
+/* largest downsampling factor used for window shadow masks */
+#define SHADOW_MASK_SCALE_MAX 8
+
+/* milliseconds between rebuilds of the alpha part of a shadow mask
+   while the window keeps changing */
+#define SHADOW_ALPHA_DELAY 100
+
 static int displayPrivateIndex;
 
 typedef struct _ShadowDisplay {
     int	screenPrivateIndex;
 } ShadowDisplay;
 
+/* shadow images are kept for the most recently used radius and
+   opacity values so that moving an option back and forth doesn't
+   compute them again */
+typedef struct _ShadowImage {
+    float	  radius;
+    float	  opacity;
+    int		  size;
+    int		  width;
+    int		  height;
+    unsigned char *data;
+} ShadowImage;
+
 #define SHADOW_SCREEN_OPTION_RADIUS   0
 #define SHADOW_SCREEN_OPTION_OPACITY  1
 #define SHADOW_SCREEN_OPTION_EXPAND   2
 #define SHADOW_SCREEN_OPTION_OFFSET_X 3
 #define SHADOW_SCREEN_OPTION_OFFSET_Y 4
-#define SHADOW_SCREEN_OPTION_NUM      5
+#define SHADOW_SCREEN_OPTION_SHAPED   5
+#define SHADOW_SCREEN_OPTION_NUM      6
 
 typedef struct _ShadowScreen {
+    int windowPrivateIndex;
+
     CompOption opt[SHADOW_SCREEN_OPTION_NUM];
 
     GLenum target;
     GLuint texture;
     float  dx, dy;
+    float  radius;
+    float  opacity;
+
+    ShadowImage cache[SHADOW_CACHE_SIZE];
+    int		nCache;
 
     int size;
     int expand;
     int xOffset;
     int yOffset;
 
+    /* incremented when cached window geometry is no longer valid */
+    unsigned int serial;
+
+    /* shadows of consecutive windows that don't need to interleave
+       with anything drawn in between are collected here and drawn
+       together */
+    GLfloat  *batchVertices;
+    GLushort *batchColors;
+    int	     batchSize;
+    int	     batchCount;
+
+    PaintScreenProc	   paintScreen;
     PaintWindowProc        paintWindow;
+    DrawWindowGeometryProc drawWindowGeometry;
     DamageWindowRegionProc damageWindowRegion;
     DamageWindowRectProc   damageWindowRect;
 } ShadowScreen;
 
+/* vertex stride is 2 + 2 * nMatrix floats and nMatrix is at most 2 */
+#define SHADOW_VERTEX_SIZE (9 * 4 * 6)
+
+typedef struct _ShadowWindow {
+    unsigned int serial;
+    int		 nMatrix;
+    BoxRec	 extents;
+    CompMatrix	 matrix;
+    BoxRec	 bounds;
+    GLfloat	 vertices[SHADOW_VERTEX_SIZE];
+    int		 vCount;
+
+    /* blurred low resolution mask of the window shape and alpha
+       channel used for shaped shadows */
+    GLuint	 maskTexture;
+    GLenum	 maskTarget;
+    int		 maskWidth;
+    int		 maskHeight;
+    int		 maskScale;
+    unsigned int maskSerial;
+    int		 maskWindowWidth;
+    int		 maskWindowHeight;
+    BoxPtr	 maskRects;
+    int		 maskNRects;
+
+    /* the alpha channel is read back again when the timeout fires */
+    Bool	      alphaDamaged;
+    CompTimeoutHandle alphaTimeout;
+} ShadowWindow;
+
 #define GET_SHADOW_DISPLAY(d)				       \
     ((ShadowDisplay *) (d)->privates[displayPrivateIndex].ptr)
 
@@ -93,21 +167,25 @@ typedef struct _ShadowScreen {
 #define SHADOW_SCREEN(s)						      \
     ShadowScreen *ss = GET_SHADOW_SCREEN (s, GET_SHADOW_DISPLAY (s->display))
 
-#define NUM_OPTIONS(s) (sizeof ((s)->opt) / sizeof (CompOption))
+#define GET_SHADOW_WINDOW(w, ss)				   \
+    ((ShadowWindow *) (w)->privates[(ss)->windowPrivateIndex].ptr)
 
-#define SHADOW_WINDOW(w) ((w)->type != (w)->screen->display->winDesktopAtom)
+#define SHADOW_WINDOW(w)					 \
+    ShadowWindow *sw = GET_SHADOW_WINDOW  (w,		 \
+		       GET_SHADOW_SCREEN  (w->screen,	 \
+		       GET_SHADOW_DISPLAY (w->screen->display)))
 
-static float
-gaussian (float r,
-	  float x,
-	  float y)
-{
-    return (1 / (sqrt (2 * M_PI * r))) * exp ((- (x * x + y * y)) / (2 * r * r));
-}
+#define NUM_OPTIONS(s) (sizeof ((s)->opt) / sizeof (CompOption))
 
+#define HAS_SHADOW(w) ((w)->type != (w)->screen->display->winDesktopAtom)
+
+/* the gaussian is separable so a 2D map normalized to sum 1 is the
+   product of a normalized 1D kernel with itself, the sum over any
+   rectangle of the map is then the product of two ranges of the 1D
+   kernel which are looked up in a prefix sum table */
 typedef struct _ShadowMap {
     int	  size;
-    float *data;
+    float *sum;
 } ShadowMap;
 
 static ShadowMap *
@@ -116,32 +194,28 @@ shadowCreateGaussianMap (float r)
     ShadowMap *m;
     int	      size = ((int) ceil ((r * 3)) + 1) & ~1;
     int	      center = size / 2;
-    int	      x, y;
-    float     t, g;
+    int	      x;
+    float     t;
+
+    m = malloc (sizeof (ShadowMap) + (size + 1) * sizeof (float));
+    if (!m)
+	return NULL;
 
-    m = malloc (sizeof (ShadowMap) + size * size * sizeof (float));
     m->size = size;
-    m->data = (float *) (m + 1);
-    t = 0.0;
+    m->sum  = (float *) (m + 1);
 
-    for (y = 0; y < size; y++)
-    {
-	for (x = 0; x < size; x++)
-	{
-	    g = gaussian (r, (float) (x - center), (float) (y - center));
-	    t += g;
-	    m->data[y * size + x] = g;
-	}
-    }
+    t = 0.0f;
+    m->sum[0] = 0.0f;
 
-    for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++)
     {
-	for (x = 0; x < size; x++)
-	{
-	    m->data[y * size + x] /= t;
-	}
+	t += exp (-((x - center) * (x - center)) / (2 * r * r));
+	m->sum[x + 1] = t;
     }
 
+    for (x = 1; x <= size; x++)
+	m->sum[x] /= t;
+
     return m;
 }
 
@@ -153,9 +227,6 @@ shadowSumGaussian (ShadowMap *map,
 		   int       width,
 		   int       height)
 {
-    int	  fx, fy;
-    float *g_data;
-    float *g_line = map->data;
     int	  g_size = map->size;
     int	  center = g_size / 2;
     int	  fx_start, fx_end;
@@ -185,17 +256,11 @@ shadowSumGaussian (ShadowMap *map,
     if (fy_end > g_size)
 	fy_end = g_size;
 
-    g_line = g_line + fy_start * g_size + fx_start;
-
-    v = 0;
-    for (fy = fy_start; fy < fy_end; fy++)
-    {
-	g_data = g_line;
-	g_line += g_size;
+    if (fx_start >= fx_end || fy_start >= fy_end)
+	return 0;
 
-	for (fx = fx_start; fx < fx_end; fx++)
-	    v += *g_data++;
-    }
+    v = (map->sum[fx_end] - map->sum[fx_start]) *
+	(map->sum[fy_end] - map->sum[fy_start]);
     if (v > 1)
 	v = 1;
 
@@ -285,29 +350,78 @@ shadowCreateImage (ShadowMap *map,
     return data;
 }
 
+static ShadowImage *
+shadowLookupImage (ShadowScreen *ss,
+		   float	radius,
+		   float	opacity)
+{
+    ShadowImage image;
+    ShadowMap   *map;
+    int		i;
+
+    for (i = 0; i < ss->nCache; i++)
+	if (ss->cache[i].radius == radius && ss->cache[i].opacity == opacity)
+	    break;
+
+    if (i < ss->nCache)
+    {
+	image = ss->cache[i];
+    }
+    else
+    {
+	map = shadowCreateGaussianMap (radius);
+	if (!map)
+	    return NULL;
+
+	image.data = shadowCreateImage (map, opacity,
+					&image.width, &image.height);
+	image.size = map->size;
+
+	free (map);
+
+	if (!image.data)
+	    return NULL;
+
+	image.radius  = radius;
+	image.opacity = opacity;
+
+	if (ss->nCache == SHADOW_CACHE_SIZE)
+	    free (ss->cache[--ss->nCache].data);
+
+	i = ss->nCache++;
+    }
+
+    /* most recently used first */
+    memmove (&ss->cache[1], &ss->cache[0], i * sizeof (ShadowImage));
+    ss->cache[0] = image;
+
+    return &ss->cache[0];
+}
+
 static void
 shadowComputeGaussian (CompScreen *s,
 		       float      radius,
 		       float	  opacity)
 {
-    ShadowMap     *map;
-    unsigned char *data;
-    int		  w, h;
+    ShadowImage *image;
+    int		w, h;
 
     SHADOW_SCREEN (s);
 
-    map = shadowCreateGaussianMap (radius);
-    if (!map)
+    if (ss->texture && ss->radius == radius && ss->opacity == opacity)
 	return;
 
-    data = shadowCreateImage (map, opacity, &w, &h);
-    if (!data)
-    {
-	free (map);
+    image = shadowLookupImage (ss, radius, opacity);
+    if (!image)
 	return;
-    }
 
-    ss->size = map->size;
+    w = image->width;
+    h = image->height;
+
+    ss->size    = image->size;
+    ss->radius  = radius;
+    ss->opacity = opacity;
+    ss->serial++;
 
     if (s->textureNonPowerOfTwo || (POWER_OF_TWO (w) && POWER_OF_TWO (h)))
     {
@@ -327,7 +441,7 @@ shadowComputeGaussian (CompScreen *s,
 
     glBindTexture (ss->target, ss->texture);
     glTexImage2D (ss->target, 0, GL_INTENSITY, w, h, 0,
-		  GL_LUMINANCE, GL_UNSIGNED_BYTE, data);
+		  GL_LUMINANCE, GL_UNSIGNED_BYTE, image->data);
 
     glTexParameteri (ss->target, GL_TEXTURE_WRAP_S, GL_CLAMP);
     glTexParameteri (ss->target, GL_TEXTURE_WRAP_T, GL_CLAMP);
@@ -338,9 +452,6 @@ shadowComputeGaussian (CompScreen *s,
 		     s->display->textureFilter);
 
     glBindTexture (GL_TEXTURE_2D, 0);
-
-    free (data);
-    free (map);
 }
 
 static CompOption *
@@ -392,6 +503,7 @@ shadowSetScreenOption (CompScreen      *screen,
 	if (compSetIntOption (o, value))
 	{
 	    ss->expand = o->value.i;
+	    ss->serial++;
 	    damageScreen (screen);
 	    return TRUE;
 	}
@@ -400,6 +512,7 @@ shadowSetScreenOption (CompScreen      *screen,
 	if (compSetIntOption (o, value))
 	{
 	    ss->xOffset = o->value.i;
+	    ss->serial++;
 	    damageScreen (screen);
 	    return TRUE;
 	}
@@ -408,6 +521,14 @@ shadowSetScreenOption (CompScreen      *screen,
 	if (compSetIntOption (o, value))
 	{
 	    ss->yOffset = o->value.i;
+	    ss->serial++;
+	    damageScreen (screen);
+	    return TRUE;
+	}
+	break;
+    case SHADOW_SCREEN_OPTION_SHAPED:
+	if (compSetBoolOption (o, value))
+	{
 	    damageScreen (screen);
 	    return TRUE;
 	}
@@ -469,8 +590,84 @@ shadowScreenInitOptions (ShadowScreen *fs)
     o->value.i		= SHADOW_OFFSET_Y_DEFAULT;
     o->rest.i.min	= SHADOW_OFFSET_Y_MIN;
     o->rest.i.max	= SHADOW_OFFSET_Y_MAX;
+
+    o = &fs->opt[SHADOW_SCREEN_OPTION_SHAPED];
+    o->name		= "shaped";
+    o->shortDesc	= "Shaped shadows";
+    o->longDesc		= "Drop shadows follow window shape and alpha "
+	"channel";
+    o->type		= CompOptionTypeBool;
+    o->value.b		= SHADOW_SHAPED_DEFAULT;
+}
+
+/* area covered by the shadow of a window with the given extents */
+static void
+shadowWindowFootprint (CompWindow *w,
+		       BoxPtr	  extents,
+		       BoxPtr	  box)
+{
+    SHADOW_SCREEN (w->screen);
+
+    box->x1 = extents->x1 - ss->expand + ss->xOffset;
+    box->y1 = extents->y1 - ss->expand + ss->yOffset;
+    box->x2 = extents->x2 + ss->expand + ss->xOffset;
+    box->y2 = extents->y2 + ss->expand + ss->yOffset;
+}
+
+/* when the footprint contains the damaged area the window doesn't have
+   to damage it again */
+static Bool
+shadowFootprintContains (BoxPtr box,
+			 BoxPtr extents)
+{
+    return (box->x1 <= extents->x1 && box->y1 <= extents->y1 &&
+	    box->x2 >= extents->x2 && box->y2 >= extents->y2);
+}
+
+static Bool
+shadowAlphaTimeout (void *closure)
+{
+    CompWindow *w = closure;
+    REGION     region;
+
+    SHADOW_WINDOW (w);
+
+    sw->alphaTimeout = 0;
+    sw->alphaDamaged = TRUE;
+
+    region.rects = &region.extents;
+    region.numRects = region.size = 1;
+
+    shadowWindowFootprint (w, &w->region->extents, &region.extents);
+
+    damageScreenRegion (w->screen, &region);
+
+    return FALSE;
+}
+
+/* content damage of alpha windows with shaped shadows is picked up at
+   most once per SHADOW_ALPHA_DELAY, restarting the timeout defers the
+   update until the window has stopped changing */
+static void
+shadowScheduleAlphaUpdate (CompWindow *w,
+			   Bool	      restart)
+{
+    SHADOW_WINDOW (w);
+
+    if (sw->alphaTimeout)
+    {
+	if (!restart)
+	    return;
+
+	compRemoveTimeout (sw->alphaTimeout);
+    }
+
+    sw->alphaTimeout = compAddTimeout (SHADOW_ALPHA_DELAY,
+				       shadowAlphaTimeout, w);
 }
 
+/* region damage is only used when a window is mapped, unmapped, moved
+   or resized and then the whole shadow footprint changes */
 static Bool
 shadowDamageWindowRegion (CompWindow *w,
 			  Region     region)
@@ -483,27 +680,27 @@ shadowDamageWindowRegion (CompWindow *w,
     status = (*w->screen->damageWindowRegion) (w, region);
     WRAP (ss, w->screen, damageWindowRegion, shadowDamageWindowRegion);
 
-    if (SHADOW_WINDOW (w))
+    if (HAS_SHADOW (w))
     {
 	REGION rect;
 
 	rect.rects = &rect.extents;
 	rect.numRects = rect.size = 1;
 
-	rect.extents.x1 = region->extents.x1 - ss->expand + ss->xOffset;
-	rect.extents.y1 = region->extents.y1 - ss->expand + ss->yOffset;
-	rect.extents.x2 = region->extents.x2 + ss->expand + ss->xOffset;
-	rect.extents.y2 = region->extents.y2 + ss->expand + ss->yOffset;
+	shadowWindowFootprint (w, &region->extents, &rect.extents);
 
 	damageScreenRegion (w->screen, &rect);
 
-	if (ss->expand >= ss->xOffset && ss->expand >= ss->yOffset)
+	if (shadowFootprintContains (&rect.extents, &region->extents))
 	    status = TRUE;
     }
 
     return status;
 }
 
+/* content damage only changes the shadow of alpha windows where the
+   shadow is modulated by the window's alpha channel, that's the
+   damaged rectangle moved by the shadow offset */
 static Bool
 shadowDamageWindowRect (CompWindow *w,
 			Bool	   initial,
@@ -517,7 +714,7 @@ shadowDamageWindowRect (CompWindow *w,
     status = (*w->screen->damageWindowRect) (w, initial, rect);
     WRAP (ss, w->screen, damageWindowRect, shadowDamageWindowRect);
 
-    if (SHADOW_WINDOW (w))
+    if (HAS_SHADOW (w))
     {
 	REGION region;
 
@@ -526,190 +723,1107 @@ shadowDamageWindowRect (CompWindow *w,
 
 	if (initial)
 	{
-	    region.extents.x1 = w->region->extents.x1 - ss->expand + ss->xOffset;
-	    region.extents.y1 = w->region->extents.y1 - ss->expand + ss->yOffset;
-	    region.extents.x2 = w->region->extents.x2 + ss->expand + ss->xOffset;
-	    region.extents.y2 = w->region->extents.y2 + ss->expand + ss->yOffset;
+	    shadowWindowFootprint (w, &w->region->extents, &region.extents);
+
+	    damageScreenRegion (w->screen, &region);
+
+	    if (shadowFootprintContains (&region.extents, rect))
+		status = TRUE;
 	}
-	else if (w->alpha)
+	else if (w->alpha && ss->opt[SHADOW_SCREEN_OPTION_SHAPED].value.b)
+	    shadowScheduleAlphaUpdate (w, FALSE);
+	else if (w->alpha				      &&
+		 !ss->opt[SHADOW_SCREEN_OPTION_SHAPED].value.b &&
+		 w->screen->textureEnvCombine		      &&
+		 w->screen->maxTextureUnits > 1)
 	{
-	    region.extents.x1 = rect->x1 - ss->expand + ss->xOffset;
-	    region.extents.y1 = rect->y1 - ss->expand + ss->yOffset;
-	    region.extents.x2 = rect->x2 + ss->expand + ss->xOffset;
-	    region.extents.y2 = rect->y2 + ss->expand + ss->yOffset;
-	}
-	else
-	    return status;
+	    if (!ss->xOffset && !ss->yOffset)
+		return status;
 
-	damageScreenRegion (w->screen, &region);
+	    region.extents.x1 = rect->x1 + ss->xOffset;
+	    region.extents.y1 = rect->y1 + ss->yOffset;
+	    region.extents.x2 = rect->x2 + ss->xOffset;
+	    region.extents.y2 = rect->y2 + ss->yOffset;
 
-	if (ss->expand >= ss->xOffset && ss->expand >= ss->yOffset)
-	    status = TRUE;
+	    damageScreenRegion (w->screen, &region);
+	}
     }
 
     return status;
 }
 
+static void
+shadowAddQuad (ShadowWindow *sw,
+	       CompMatrix   *matrix,
+	       int	    nMatrix,
+	       BoxPtr	    box)
+{
+    GLfloat *d = sw->vertices + sw->vCount * (2 + nMatrix * 2);
+    int     x[4], y[4];
+    int     i, it;
+
+    if (box->x1 >= box->x2 || box->y1 >= box->y2)
+	return;
+
+    x[0] = box->x1; y[0] = box->y2;
+    x[1] = box->x2; y[1] = box->y2;
+    x[2] = box->x2; y[2] = box->y1;
+    x[3] = box->x1; y[3] = box->y1;
+
+    for (i = 0; i < 4; i++)
+    {
+	for (it = 0; it < nMatrix; it++)
+	{
+	    *d++ = COMP_TEX_COORD_X (&matrix[it], x[i], y[i]);
+	    *d++ = COMP_TEX_COORD_Y (&matrix[it], x[i], y[i]);
+	}
+	*d++ = x[i];
+	*d++ = y[i];
+    }
+
+    sw->vCount += 4;
+}
+
+/* adds the nine shadow slices through the addWindowGeometry chain or,
+   when sw is not NULL, unclipped to the window's geometry cache */
+static void
+shadowAddGeometry (CompWindow   *w,
+		   CompMatrix   *matrix,
+		   int		nMatrix,
+		   Region	region,
+		   ShadowWindow *sw)
+{
+    REGION rect;
+    BoxRec box;
+
+    SHADOW_SCREEN (w->screen);
+
+    box.x1 = w->region->extents.x1 - ss->expand + ss->size;
+    box.y1 = w->region->extents.y1 - ss->expand + ss->size;
+    box.x2 = w->region->extents.x2 + ss->expand - ss->size;
+    box.y2 = w->region->extents.y2 + ss->expand - ss->size;
+
+    /* in case window width is too small */
+    if (box.x1 >= box.x2)
+    {
+	box.x1 = (w->region->extents.x1 + w->region->extents.x2) / 2;
+	box.x2 = box.x1 + 1;
+    }
+
+    /* in case window height is too small */
+    if (box.y1 >= box.y2)
+    {
+	box.y1 = (w->region->extents.y1 + w->region->extents.y2) / 2;
+	box.y2 = box.y1 + 1;
+    }
+
+#define ADD_SLICE()							\
+    if (sw)								\
+	shadowAddQuad (sw, matrix, nMatrix, &rect.extents);		\
+    else								\
+	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region)
+
+    rect.rects = &rect.extents;
+    rect.numRects = rect.size = 1;
+
+    /* top left */
+    matrix->xx = ss->dx; matrix->xy = 0.0f;
+    matrix->yx = 0.0f;   matrix->yy = ss->dy;
+
+    matrix->x0 = -((box.x1 - ss->size + ss->xOffset) * ss->dx);
+    matrix->y0 = -((box.y1 - ss->size + ss->yOffset) * ss->dy);
+
+    rect.extents.x1 = box.x1 - ss->size + ss->xOffset;
+    rect.extents.y1 = box.y1 - ss->size + ss->yOffset;
+    rect.extents.x2 = rect.extents.x1 + ss->size;
+    rect.extents.y2 = rect.extents.y1 + ss->size;
+
+    ADD_SLICE ();
+
+    /* top */
+    matrix->xx = 0.0f;
+    matrix->x0 = ss->dx * ss->size;
+
+    rect.extents.x1 = rect.extents.x2;
+    rect.extents.x2 = box.x2 + ss->xOffset;
+
+    ADD_SLICE ();
+
+    /* top right */
+    matrix->x0 = -((box.x2 - ss->size + ss->xOffset) * ss->dx);
+    matrix->xx = ss->dx;
+
+    rect.extents.x1 = rect.extents.x2;
+    rect.extents.x2 = box.x2 + ss->size + ss->xOffset;
+
+    ADD_SLICE ();
+
+    /* left */
+    matrix->x0 = -((box.x1 - ss->size + ss->xOffset) * ss->dx);
+    matrix->xx = ss->dx;
+    matrix->yy = 0.0f;
+    matrix->y0 = ss->dy * ss->size;
+
+    rect.extents.x1 = box.x1 - ss->size + ss->xOffset;
+    rect.extents.y1 = rect.extents.y2;
+    rect.extents.x2 = rect.extents.x1 + ss->size;
+    rect.extents.y2 = box.y2 + ss->yOffset;
+
+    ADD_SLICE ();
+
+    /* middle */
+    matrix->xx = 0.0f;
+    matrix->x0 = ss->dx * ss->size;
+
+    rect.extents.x1 = rect.extents.x2;
+    rect.extents.x2 = box.x2 + ss->xOffset;
+
+    ADD_SLICE ();
+
+    /* right */
+    matrix->x0 = -((box.x2 - ss->size + ss->xOffset) * ss->dx);
+    matrix->xx = ss->dx;
+
+    rect.extents.x1 = rect.extents.x2;
+    rect.extents.x2 = box.x2 + ss->size + ss->xOffset;
+
+    ADD_SLICE ();
+
+    /* bottom left */
+    matrix->yy = ss->dy;
+    matrix->x0 = -((box.x1 - ss->size + ss->xOffset) * ss->dx);
+    matrix->y0 = -((box.y2 - ss->size + ss->yOffset) * ss->dy);
+
+    rect.extents.x1 = box.x1 - ss->size + ss->xOffset;
+    rect.extents.y1 = rect.extents.y2;
+    rect.extents.x2 = rect.extents.x1 + ss->size;
+    rect.extents.y2 = box.y2 + ss->size + ss->yOffset;
+
+    ADD_SLICE ();
+
+    /* bottom */
+    matrix->xx = 0.0f;
+    matrix->x0 = ss->dx * ss->size;
+
+    rect.extents.x1 = rect.extents.x2;
+    rect.extents.x2 = box.x2 + ss->xOffset;
+
+    ADD_SLICE ();
+
+    /* bottom right */
+    matrix->x0 = -((box.x2 - ss->size + ss->xOffset) * ss->dx);
+    matrix->xx = ss->dx;
+
+    rect.extents.x1 = rect.extents.x2;
+    rect.extents.x2 = box.x2 + ss->size + ss->xOffset;
+
+    ADD_SLICE ();
+
+#undef ADD_SLICE
+}
+
+/* the cached slices only depend on the window extents, the shadow
+   options and the window texture matrix */
+static void
+shadowValidateGeometry (CompWindow *w,
+			CompMatrix *matrix,
+			int	   nMatrix)
+{
+    SHADOW_SCREEN (w->screen);
+    SHADOW_WINDOW (w);
+
+    if (sw->serial     == ss->serial		 &&
+	sw->nMatrix    == nMatrix		 &&
+	sw->extents.x1 == w->region->extents.x1 &&
+	sw->extents.y1 == w->region->extents.y1 &&
+	sw->extents.x2 == w->region->extents.x2 &&
+	sw->extents.y2 == w->region->extents.y2 &&
+	(nMatrix < 2 ||
+	 !memcmp (&sw->matrix, &matrix[1], sizeof (CompMatrix))))
+	return;
+
+    sw->serial  = ss->serial;
+    sw->nMatrix = nMatrix;
+    sw->extents = w->region->extents;
+    if (nMatrix > 1)
+	sw->matrix = matrix[1];
+
+    sw->vCount = 0;
+    shadowAddGeometry (w, matrix, nMatrix, NULL, sw);
+
+    shadowWindowFootprint (w, &w->region->extents, &sw->bounds);
+}
+
+static void
+shadowDrawGeometry (CompWindow *w,
+		    Region     region,
+		    Bool       scissor)
+{
+    int     texUnit, currentTexUnit = 0;
+    int     stride, y;
+    GLfloat *vertices;
+    BoxPtr  pBox;
+    int	    nBox;
+
+    SHADOW_WINDOW (w);
+
+    texUnit  = sw->nMatrix;
+    stride   = (1 + texUnit) * 2;
+    vertices = sw->vertices + (stride - 2);
+
+    stride *= sizeof (GLfloat);
+
+    glVertexPointer (2, GL_FLOAT, stride, vertices);
+
+    while (texUnit--)
+    {
+	if (texUnit != currentTexUnit)
+	{
+	    w->screen->clientActiveTexture (GL_TEXTURE0_ARB + texUnit);
+	    currentTexUnit = texUnit;
+	}
+	vertices -= 2;
+	glTexCoordPointer (2, GL_FLOAT, stride, vertices);
+    }
+
+    /* a clip that covers the whole screen needs no scissor, this also
+       leaves any scissor set up by the caller alone */
+    if (region->numRects == 1			&&
+	region->extents.x1 <= 0			&&
+	region->extents.y1 <= 0			&&
+	region->extents.x2 >= w->screen->width  &&
+	region->extents.y2 >= w->screen->height)
+	scissor = FALSE;
+
+    if (!scissor)
+    {
+	glDrawArrays (GL_QUADS, 0, sw->vCount);
+	return;
+    }
+
+    /* one draw per clip rectangle that intersects the shadow, a single
+       rectangle clip is the common case */
+    glEnable (GL_SCISSOR_TEST);
+
+    pBox = region->rects;
+    nBox = region->numRects;
+    while (nBox--)
+    {
+	if (pBox->x1 < sw->bounds.x2 && pBox->x2 > sw->bounds.x1 &&
+	    pBox->y1 < sw->bounds.y2 && pBox->y2 > sw->bounds.y1)
+	{
+	    y = w->screen->height - pBox->y2;
+
+	    glScissor (pBox->x1, y,
+		       pBox->x2 - pBox->x1,
+		       pBox->y2 - pBox->y1);
+
+	    glDrawArrays (GL_QUADS, 0, sw->vCount);
+	}
+
+	pBox++;
+    }
+
+    glDisable (GL_SCISSOR_TEST);
+}
+
 static Bool
-shadowPaintWindow (CompWindow		   *w,
-		   const WindowPaintAttrib *attrib,
+shadowMoreBatchVertices (ShadowScreen *ss,
+			 int	      newSize)
+{
+    if (newSize > ss->batchSize)
+    {
+	GLfloat  *vertices;
+	GLushort *colors;
+
+	vertices = realloc (ss->batchVertices, sizeof (GLfloat) * 4 * newSize);
+	if (!vertices)
+	    return FALSE;
+
+	ss->batchVertices = vertices;
+
+	colors = realloc (ss->batchColors, sizeof (GLushort) * 4 * newSize);
+	if (!colors)
+	    return FALSE;
+
+	ss->batchColors = colors;
+	ss->batchSize   = newSize;
+    }
+
+    return TRUE;
+}
+
+/* clips the cached slices of a window with a single texture matrix to
+   region and adds them to the batch, texture coordinates are affine
+   in x and y so they are interpolated from the quad corners */
+static void
+shadowBatchGeometry (CompWindow *w,
+		     Region	region,
+		     GLushort	opacity)
+{
+    GLfloat  *q, *d;
+    GLushort *c;
+    BoxPtr   pBox;
+    int	     nBox, n, i;
+    float    x1, y1, x2, y2, sx, sy;
+    float    x[4], y[4];
+
+    SHADOW_SCREEN (w->screen);
+    SHADOW_WINDOW (w);
+
+    pBox = region->rects;
+    nBox = region->numRects;
+
+    for (; nBox--; pBox++)
+    {
+	if (pBox->x1 >= sw->bounds.x2 || pBox->x2 <= sw->bounds.x1 ||
+	    pBox->y1 >= sw->bounds.y2 || pBox->y2 <= sw->bounds.y1)
+	    continue;
+
+	if (!shadowMoreBatchVertices (ss, ss->batchCount + sw->vCount))
+	    return;
+
+	d = ss->batchVertices + ss->batchCount * 4;
+	c = ss->batchColors + ss->batchCount * 4;
+
+	for (n = 0; n < sw->vCount; n += 4)
+	{
+	    /* corners are stored as (x1, y2) (x2, y2) (x2, y1) (x1, y1) */
+	    q = sw->vertices + n * 4;
+
+	    x1 = q[14];
+	    y1 = q[15];
+	    x2 = q[6];
+	    y2 = q[7];
+
+	    x[0] = x[3] = MAX (x1, pBox->x1);
+	    x[1] = x[2] = MIN (x2, pBox->x2);
+	    y[2] = y[3] = MAX (y1, pBox->y1);
+	    y[0] = y[1] = MIN (y2, pBox->y2);
+
+	    if (x[0] >= x[1] || y[3] >= y[0])
+		continue;
+
+	    for (i = 0; i < 4; i++)
+	    {
+		sx = (x[i] - x1) / (x2 - x1);
+		sy = (y[i] - y1) / (y2 - y1);
+
+		*d++ = q[12] + sx * (q[8] - q[12]) + sy * (q[0] - q[12]);
+		*d++ = q[13] + sx * (q[9] - q[13]) + sy * (q[1] - q[13]);
+		*d++ = x[i];
+		*d++ = y[i];
+
+		*c++ = 0;
+		*c++ = 0;
+		*c++ = 0;
+		*c++ = opacity;
+	    }
+
+	    ss->batchCount += 4;
+	}
+    }
+}
+
+static void
+shadowFlushBatch (CompScreen *s)
+{
+    SHADOW_SCREEN (s);
+
+    if (!ss->batchCount)
+	return;
+
+    glEnable (GL_BLEND);
+
+    glEnable (ss->target);
+    glBindTexture (ss->target, ss->texture);
+
+    glTexEnvf (GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+
+    glEnableClientState (GL_COLOR_ARRAY);
+
+    glColorPointer (4, GL_UNSIGNED_SHORT, 0, ss->batchColors);
+    glTexCoordPointer (2, GL_FLOAT, sizeof (GLfloat) * 4, ss->batchVertices);
+    glVertexPointer (2, GL_FLOAT, sizeof (GLfloat) * 4,
+		     ss->batchVertices + 2);
+
+    glDrawArrays (GL_QUADS, 0, ss->batchCount);
+
+    glDisableClientState (GL_COLOR_ARRAY);
+
+    glBindTexture (ss->target, 0);
+    glDisable (ss->target);
+
+    glTexEnvi (GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    glColor4usv (defaultColor);
+    glDisable (GL_BLEND);
+
+    ss->batchCount = 0;
+}
+
+/* pending shadows are normally drawn before a window that is going
+   to draw in the translucent pass is painted, this catches windows
+   that still draw something, state set up for the window is saved
+   and the untransformed screen coordinates are restored */
+static void
+shadowDrawWindowGeometry (CompWindow *w)
+{
+    SHADOW_SCREEN (w->screen);
+
+    if (ss->batchCount)
+    {
+	glPushAttrib (GL_ENABLE_BIT	  |
+		      GL_TEXTURE_BIT	  |
+		      GL_COLOR_BUFFER_BIT |
+		      GL_CURRENT_BIT);
+	glPushClientAttrib (GL_CLIENT_VERTEX_ARRAY_BIT);
+
+	glPushMatrix ();
+	glLoadIdentity ();
+	prepareXCoords (w->screen);
+
+	shadowFlushBatch (w->screen);
+
+	glPopMatrix ();
+
+	glPopClientAttrib ();
+	glPopAttrib ();
+    }
+
+    UNWRAP (ss, w->screen, drawWindowGeometry);
+    (*w->screen->drawWindowGeometry) (w);
+    WRAP (ss, w->screen, drawWindowGeometry, shadowDrawWindowGeometry);
+}
+
+static Bool
+shadowPaintScreen (CompScreen		   *s,
+		   const ScreenPaintAttrib *sAttrib,
+		   const WindowPaintAttrib *wAttrib,
 		   Region		   region,
 		   unsigned int		   mask)
 {
     Bool status;
 
-    SHADOW_SCREEN (w->screen);
+    SHADOW_SCREEN (s);
+
+    UNWRAP (ss, s, paintScreen);
+    status = (*s->paintScreen) (s, sAttrib, wAttrib, region, mask);
+    WRAP (ss, s, paintScreen, shadowPaintScreen);
 
-    if (SHADOW_WINDOW (w) && (!(mask & PAINT_WINDOW_SOLID_MASK)))
+    /* shadows of the top most windows, only windows painted on an
+       untransformed screen are batched */
+    if (ss->batchCount)
     {
-	CompMatrix matrix[2];
-	GLushort   opacity;
-	REGION     rect;
-	BoxRec     box;
-	int        nMatrix = 1;
+	glPushMatrix ();
+	prepareXCoords (s);
 
-	opacity = MULTIPLY_USHORT (w->opacity, attrib->opacity);
-	if (w->alpha || opacity != OPAQUE)
-	    mask |= PAINT_WINDOW_TRANSLUCENT_MASK;
-	else
-	    mask |= PAINT_WINDOW_SOLID_MASK;
+	shadowFlushBatch (s);
 
-	if (mask & PAINT_WINDOW_TRANSFORMED_MASK)
-	    region = &infiniteRegion;
+	glPopMatrix ();
+    }
+
+    return status;
+}
+
+typedef void (*ShadowLineProc) (const float *src,
+				float	    *dst,
+				int	    n,
+				int	    stride,
+				int	    r);
+
+/* box filter with zero outside the line, three passes approximate a
+   gaussian with a standard deviation of about r */
+static void
+shadowBlurLine (const float *src,
+		float	    *dst,
+		int	    n,
+		int	    stride,
+		int	    r)
+{
+    float sum = 0.0f, scale = 1.0f / (2 * r + 1);
+    int   i;
+
+    for (i = 0; i < r && i < n; i++)
+	sum += src[i * stride];
+
+    for (i = 0; i < n; i++)
+    {
+	if (i + r < n)
+	    sum += src[(i + r) * stride];
+
+	dst[i * stride] = sum * scale;
+
+	if (i - r >= 0)
+	    sum -= src[(i - r) * stride];
+    }
+}
+
+static void
+shadowDilateLine (const float *src,
+		  float	      *dst,
+		  int	      n,
+		  int	      stride,
+		  int	      r)
+{
+    float m;
+    int   i, k, k2;
+
+    for (i = 0; i < n; i++)
+    {
+	k  = MAX (0, i - r);
+	k2 = MIN (n - 1, i + r);
 
-	w->vCount = 0;
+	for (m = 0.0f; k <= k2; k++)
+	    m = MAX (m, src[k * stride]);
 
-	box.x1 = w->region->extents.x1 - ss->expand + ss->size;
-	box.y1 = w->region->extents.y1 - ss->expand + ss->size;
-	box.x2 = w->region->extents.x2 + ss->expand - ss->size;
-	box.y2 = w->region->extents.y2 + ss->expand - ss->size;
+	dst[i * stride] = m;
+    }
+}
+
+static void
+shadowFilterMask (float		 *data,
+		  float		 *tmp,
+		  int		 width,
+		  int		 height,
+		  int		 r,
+		  ShadowLineProc line)
+{
+    int i;
+
+    for (i = 0; i < height; i++)
+	(*line) (data + i * width, tmp + i * width, width, 1, r);
+
+    for (i = 0; i < width; i++)
+	(*line) (tmp + i, data + i, height, width, r);
+}
+
+/* multiplies mask texels with the window's alpha channel sampled at
+   the texel centre, the window is drawn into a mask sized framebuffer
+   so only mask texels are read back */
+static Bool
+shadowDownsampleAlpha (CompWindow    *w,
+		       float	     *data,
+		       unsigned char *bytes,
+		       int	     width,
+		       int	     height,
+		       int	     scale,
+		       int	     pad)
+{
+    CompScreen *s = w->screen;
+    CompMatrix *m = &w->texture.matrix;
+    GLfloat    vertices[16], *d = vertices;
+    GLenum     target, status;
+    GLuint     texture;
+    int	       tw = MIN (w->texture.width, w->width);
+    int	       th = MIN (w->texture.height, w->height);
+    int	       i;
+
+    if (!s->fbo)
+	return FALSE;
+
+    if (s->textureNonPowerOfTwo ||
+	(POWER_OF_TWO (width) && POWER_OF_TWO (height)))
+	target = GL_TEXTURE_2D;
+    else
+	target = GL_TEXTURE_RECTANGLE_NV;
+
+    glGenTextures (1, &texture);
+    glBindTexture (target, texture);
+    glTexImage2D (target, 0, GL_RGBA, width, height, 0,
+		  GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture (target, 0);
+
+    if (!s->mipmapFbo)
+	(*s->genFramebuffers) (1, &s->mipmapFbo);
+
+    (*s->bindFramebuffer) (GL_FRAMEBUFFER_EXT, s->mipmapFbo);
+    (*s->framebufferTexture2D) (GL_FRAMEBUFFER_EXT,
+				GL_COLOR_ATTACHMENT0_EXT,
+				target, texture, 0);
+
+    status = (*s->checkFramebufferStatus) (GL_FRAMEBUFFER_EXT);
+    if (status == GL_FRAMEBUFFER_COMPLETE_EXT)
+    {
+	*d++ = COMP_TEX_COORD_X (m, 0, 0);
+	*d++ = COMP_TEX_COORD_Y (m, 0, 0);
+	*d++ = pad;
+	*d++ = pad;
+
+	*d++ = COMP_TEX_COORD_X (m, 0, th);
+	*d++ = COMP_TEX_COORD_Y (m, 0, th);
+	*d++ = pad;
+	*d++ = pad + th;
+
+	*d++ = COMP_TEX_COORD_X (m, tw, th);
+	*d++ = COMP_TEX_COORD_Y (m, tw, th);
+	*d++ = pad + tw;
+	*d++ = pad + th;
+
+	*d++ = COMP_TEX_COORD_X (m, tw, 0);
+	*d++ = COMP_TEX_COORD_Y (m, tw, 0);
+	*d++ = pad + tw;
+	*d++ = pad;
+
+	glPushAttrib (GL_VIEWPORT_BIT	  |
+		      GL_ENABLE_BIT	  |
+		      GL_TEXTURE_BIT	  |
+		      GL_COLOR_BUFFER_BIT |
+		      GL_CURRENT_BIT);
+	glPushClientAttrib (GL_CLIENT_VERTEX_ARRAY_BIT);
+
+	glDisable (GL_BLEND);
+	glDisable (GL_SCISSOR_TEST);
+	glDisable (GL_STENCIL_TEST);
+
+	/* rows are read back bottom up, window y goes up here so that
+	   row i of the framebuffer is row i of the mask */
+	glViewport (0, 0, width, height);
+
+	glMatrixMode (GL_PROJECTION);
+	glPushMatrix ();
+	glLoadIdentity ();
+	glOrtho (0.0, width * scale, 0.0, height * scale, -1.0, 1.0);
+
+	glMatrixMode (GL_MODELVIEW);
+	glPushMatrix ();
+	glLoadIdentity ();
+
+	/* texels outside the window keep their coverage */
+	glClearColor (0.0f, 0.0f, 0.0f, 1.0f);
+	glClear (GL_COLOR_BUFFER_BIT);
+
+	enableTexture (s, &w->texture, COMP_TEXTURE_FILTER_GOOD);
+
+	glTexEnvi (GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	glColor4usv (defaultColor);
+
+	glDisableClientState (GL_COLOR_ARRAY);
+	glEnableClientState (GL_TEXTURE_COORD_ARRAY);
+	glTexCoordPointer (2, GL_FLOAT, sizeof (GLfloat) * 4, vertices);
+	glVertexPointer (2, GL_FLOAT, sizeof (GLfloat) * 4, vertices + 2);
+
+	glDrawArrays (GL_QUADS, 0, 4);
+
+	disableTexture (&w->texture);
+
+	glPixelStorei (GL_PACK_ALIGNMENT, 1);
+	glReadPixels (0, 0, width, height, GL_ALPHA, GL_UNSIGNED_BYTE, bytes);
+	glPixelStorei (GL_PACK_ALIGNMENT, 4);
+
+	glPopMatrix ();
+	glMatrixMode (GL_PROJECTION);
+	glPopMatrix ();
+	glMatrixMode (GL_MODELVIEW);
+
+	glPopClientAttrib ();
+	glPopAttrib ();
+    }
+
+    (*s->framebufferTexture2D) (GL_FRAMEBUFFER_EXT,
+				GL_COLOR_ATTACHMENT0_EXT,
+				target, 0, 0);
+    (*s->bindFramebuffer) (GL_FRAMEBUFFER_EXT, 0);
+
+    glDeleteTextures (1, &texture);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
+	return FALSE;
+
+    for (i = 0; i < width * height; i++)
+	data[i] *= bytes[i] / 255.0f;
+
+    return TRUE;
+}
+
+/* multiplies mask texels with the average alpha of the window pixels
+   they cover, this reads back the whole window texture */
+static void
+shadowApplyAlpha (CompWindow *w,
+		  float	     *data,
+		  float	     *tmp,
+		  int	     width,
+		  int	     height,
+		  int	     scale,
+		  int	     pad)
+{
+    unsigned char *alpha;
+    int		  tw = w->texture.width;
+    int		  th = w->texture.height;
+    int		  x, y, row, i;
+
+    alpha = malloc (tw * th);
+    if (!alpha)
+	return;
+
+    glBindTexture (w->texture.target, w->texture.name);
+    glPixelStorei (GL_PACK_ALIGNMENT, 1);
+    glGetTexImage (w->texture.target, 0, GL_ALPHA, GL_UNSIGNED_BYTE, alpha);
+    glPixelStorei (GL_PACK_ALIGNMENT, 4);
+    glBindTexture (w->texture.target, 0);
+
+    memset (tmp, 0, sizeof (float) * width * height * 2);
+
+    for (y = 0; y < MIN (th, w->height); y++)
+    {
+	row = (w->texture.matrix.yy < 0.0f) ? th - y - 1 : y;
 
-	/* in case window width is too small */
-	if (box.x1 >= box.x2)
+	for (x = 0; x < MIN (tw, w->width); x++)
 	{
-	    box.x1 = (w->region->extents.x1 + w->region->extents.x2) / 2;
-	    box.x2 = box.x1 + 1;
+	    i = ((y + pad) / scale) * width + (x + pad) / scale;
+
+	    tmp[i * 2]     += alpha[row * tw + x];
+	    tmp[i * 2 + 1] += 255.0f;
 	}
+    }
+
+    for (i = 0; i < width * height; i++)
+	if (tmp[i * 2 + 1])
+	    data[i] *= tmp[i * 2] / tmp[i * 2 + 1];
+
+    free (alpha);
+}
+
+static Bool
+shadowMaskChanged (CompWindow	*w,
+		   ShadowScreen *ss,
+		   ShadowWindow *sw)
+{
+    BoxPtr pBox = w->region->rects;
+    int	   i;
+
+    if (!sw->maskTexture			||
+	sw->maskSerial	     != ss->serial	||
+	sw->maskWindowWidth  != w->width	||
+	sw->maskWindowHeight != w->height	||
+	sw->maskNRects	     != w->region->numRects)
+	return TRUE;
+
+    for (i = 0; i < sw->maskNRects; i++)
+    {
+	if (sw->maskRects[i].x1 != pBox[i].x1 - w->attrib.x ||
+	    sw->maskRects[i].y1 != pBox[i].y1 - w->attrib.y ||
+	    sw->maskRects[i].x2 != pBox[i].x2 - w->attrib.x ||
+	    sw->maskRects[i].y2 != pBox[i].y2 - w->attrib.y)
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* the mask covers the window grown by the expand option, the shape is
+   dilated by what the expansion leaves after the gaussian and blurred
+   so that the shadow matches the rectangular one for plain windows */
+static Bool
+shadowUpdateMask (CompWindow *w)
+{
+    float	  *data, *tmp;
+    unsigned char *bytes;
+    BoxPtr	  pBox;
+    int		  width, height, scale, pad, r, i, n;
+    int		  x1, y1, x2, y2, tx, ty;
+    float	  ox, oy, area, v;
+    Bool	  resized;
+
+    SHADOW_SCREEN (w->screen);
+    SHADOW_WINDOW (w);
 
-	/* in case window height is too small */
-	if (box.y1 >= box.y2)
+    if (!shadowMaskChanged (w, ss, sw) && !sw->alphaDamaged)
+	return TRUE;
+
+    resized = (sw->maskTexture		      &&
+	       (sw->maskWindowWidth  != w->width ||
+		sw->maskWindowHeight != w->height));
+
+    scale = MAX (1, MIN (SHADOW_MASK_SCALE_MAX, (int) (ss->radius / 2)));
+    pad   = ss->expand;
+
+    width  = (w->width  + 2 * pad + scale - 1) / scale;
+    height = (w->height + 2 * pad + scale - 1) / scale;
+
+    data = calloc (width * height * 3, sizeof (float));
+    if (!data)
+	return FALSE;
+
+    tmp = data + width * height;
+
+    if (w->region->numRects > sw->maskNRects)
+    {
+	BoxPtr rects;
+
+	rects = realloc (sw->maskRects, sizeof (BoxRec) * w->region->numRects);
+	if (!rects)
 	{
-	    box.y1 = (w->region->extents.y1 + w->region->extents.y2) / 2;
-	    box.y2 = box.y1 + 1;
+	    free (data);
+	    return FALSE;
 	}
 
-	if (w->alpha &&
-	    w->screen->textureEnvCombine &&
-	    w->screen->maxTextureUnits > 1)
+	sw->maskRects = rects;
+    }
+
+    area = 1.0f / (scale * scale);
+
+    pBox = w->region->rects;
+    n    = w->region->numRects;
+
+    for (i = 0; i < n; i++)
+    {
+	sw->maskRects[i].x1 = pBox[i].x1 - w->attrib.x;
+	sw->maskRects[i].y1 = pBox[i].y1 - w->attrib.y;
+	sw->maskRects[i].x2 = pBox[i].x2 - w->attrib.x;
+	sw->maskRects[i].y2 = pBox[i].y2 - w->attrib.y;
+
+	x1 = MAX (0, sw->maskRects[i].x1 + pad);
+	y1 = MAX (0, sw->maskRects[i].y1 + pad);
+	x2 = MIN (width  * scale, sw->maskRects[i].x2 + pad);
+	y2 = MIN (height * scale, sw->maskRects[i].y2 + pad);
+
+	if (x1 >= x2 || y1 >= y2)
+	    continue;
+
+	for (ty = y1 / scale; ty * scale < y2; ty++)
 	{
-	    if (!w->pixmap)
-		bindWindow (w);
+	    oy = MIN (y2, (ty + 1) * scale) - MAX (y1, ty * scale);
 
-	    matrix[1] = w->texture.matrix;
-	    matrix[1].x0 -= ((w->attrib.x + ss->xOffset) * w->matrix.xx);
-	    matrix[1].y0 -= ((w->attrib.y + ss->yOffset) * w->matrix.yy);
+	    for (tx = x1 / scale; tx * scale < x2; tx++)
+	    {
+		ox = MIN (x2, (tx + 1) * scale) - MAX (x1, tx * scale);
 
-	    nMatrix++;
+		data[ty * width + tx] += ox * oy * area;
+	    }
 	}
+    }
 
-	rect.rects = &rect.extents;
-	rect.numRects = rect.size = 1;
+    sw->maskNRects	 = n;
+    sw->maskWindowWidth  = w->width;
+    sw->maskWindowHeight = w->height;
+    sw->maskSerial	 = ss->serial;
+    sw->maskScale	 = scale;
+    sw->maskWidth	 = width;
+    sw->maskHeight	 = height;
+
+    sw->alphaDamaged = FALSE;
+
+    /* without framebuffer objects the whole texture is read back, that
+       waits until the window has stopped changing size */
+    if (w->alpha && w->texture.name &&
+	!shadowDownsampleAlpha (w, data, (unsigned char *) tmp,
+				width, height, scale, pad))
+    {
+	if (resized)
+	    shadowScheduleAlphaUpdate (w, TRUE);
+	else
+	    shadowApplyAlpha (w, data, tmp, width, height, scale, pad);
+    }
+
+    r = (pad - ss->size / 2) / scale;
+    if (r > 0)
+	shadowFilterMask (data, tmp, width, height, r, shadowDilateLine);
+
+    r = (int) (ss->radius / scale + 0.5f);
+    if (r > 0)
+    {
+	for (i = 0; i < 3; i++)
+	    shadowFilterMask (data, tmp, width, height, r, shadowBlurLine);
+    }
+
+    bytes = (unsigned char *) tmp;
+    for (i = 0; i < width * height; i++)
+    {
+	v = data[i];
+	if (v > 1.0f)
+	    v = 1.0f;
 
-	/* top left */
-	matrix->xx = ss->dx; matrix->xy = 0.0f;
-	matrix->yx = 0.0f;   matrix->yy = ss->dy;
+	bytes[i] = (unsigned char) (v * ss->opacity * 255.0f);
+    }
 
-	matrix->x0 = -((box.x1 - ss->size + ss->xOffset) * ss->dx);
-	matrix->y0 = -((box.y1 - ss->size + ss->yOffset) * ss->dy);
+    if (w->screen->textureNonPowerOfTwo ||
+	(POWER_OF_TWO (width) && POWER_OF_TWO (height)))
+	sw->maskTarget = GL_TEXTURE_2D;
+    else
+	sw->maskTarget = GL_TEXTURE_RECTANGLE_NV;
 
-	rect.extents.x1 = box.x1 - ss->size + ss->xOffset;
-	rect.extents.y1 = box.y1 - ss->size + ss->yOffset;
-	rect.extents.x2 = rect.extents.x1 + ss->size;
-	rect.extents.y2 = rect.extents.y1 + ss->size;
+    if (!sw->maskTexture)
+	glGenTextures (1, &sw->maskTexture);
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+    glBindTexture (sw->maskTarget, sw->maskTexture);
 
-	/* top */
-	matrix->xx = 0.0f;
-	matrix->x0 = ss->dx * ss->size;
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D (sw->maskTarget, 0, GL_INTENSITY, width, height, 0,
+		  GL_LUMINANCE, GL_UNSIGNED_BYTE, bytes);
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
 
-	rect.extents.x1 = rect.extents.x2;
-	rect.extents.x2 = box.x2 + ss->xOffset;
+    glTexParameteri (sw->maskTarget, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri (sw->maskTarget, GL_TEXTURE_WRAP_T, GL_CLAMP);
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+    glTexParameteri (sw->maskTarget, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri (sw->maskTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-	/* top right */
-	matrix->x0 = -((box.x2 - ss->size + ss->xOffset) * ss->dx);
-	matrix->xx = ss->dx;
+    glBindTexture (sw->maskTarget, 0);
 
-	rect.extents.x1 = rect.extents.x2;
-	rect.extents.x2 = box.x2 + ss->size + ss->xOffset;
+    free (data);
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+    return TRUE;
+}
 
-	/* left */
-	matrix->x0 = -((box.x1 - ss->size + ss->xOffset) * ss->dx);
-	matrix->xx = ss->dx;
-	matrix->yy = 0.0f;
-	matrix->y0 = ss->dy * ss->size;
+/* a single quad textured with the window's shadow mask */
+static Bool
+shadowAddShapedGeometry (CompWindow *w,
+			 CompMatrix *matrix,
+			 Region	    region)
+{
+    REGION rect;
+    float  sx, sy;
+
+    SHADOW_SCREEN (w->screen);
+    SHADOW_WINDOW (w);
+
+    if (w->alpha)
+    {
+	if (!w->pixmap || w->resizeDamaged)
+	    bindWindow (w);
+	else if (w->texture.damage)
+	    updatePixmapTexture (w->screen, &w->texture);
+    }
 
-	rect.extents.x1 = box.x1 - ss->size + ss->xOffset;
-	rect.extents.y1 = rect.extents.y2;
-	rect.extents.x2 = rect.extents.x1 + ss->size;
-	rect.extents.y2 = box.y2 + ss->yOffset;
+    if (!shadowUpdateMask (w))
+	return FALSE;
+
+    rect.rects = &rect.extents;
+    rect.numRects = rect.size = 1;
+
+    rect.extents.x1 = w->attrib.x - ss->expand + ss->xOffset;
+    rect.extents.y1 = w->attrib.y - ss->expand + ss->yOffset;
+    rect.extents.x2 = w->attrib.x + w->width  + ss->expand + ss->xOffset;
+    rect.extents.y2 = w->attrib.y + w->height + ss->expand + ss->yOffset;
+
+    sx = 1.0f / sw->maskScale;
+    sy = 1.0f / sw->maskScale;
+    if (sw->maskTarget == GL_TEXTURE_2D)
+    {
+	sx /= sw->maskWidth;
+	sy /= sw->maskHeight;
+    }
+
+    matrix->xx = sx;   matrix->xy = 0.0f;
+    matrix->yx = 0.0f; matrix->yy = sy;
+    matrix->x0 = -(rect.extents.x1 * sx);
+    matrix->y0 = -(rect.extents.y1 * sy);
+
+    w->vCount = 0;
+
+    (*w->screen->addWindowGeometry) (w, matrix, 1, &rect, region);
+
+    return (w->vCount > 0);
+}
+
+static Bool
+shadowPaintWindow (CompWindow		   *w,
+		   const WindowPaintAttrib *attrib,
+		   Region		   region,
+		   unsigned int		   mask)
+{
+    Bool status;
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+    SHADOW_SCREEN (w->screen);
 
-	/* middle */
-	matrix->xx = 0.0f;
-	matrix->x0 = ss->dx * ss->size;
+    if (HAS_SHADOW (w) && (!(mask & PAINT_WINDOW_SOLID_MASK)))
+    {
+	CompMatrix matrix[2];
+	GLushort   opacity;
+	GLenum	   target;
+	GLuint	   texture;
+	Bool	   cached, draw, paints;
+	int        nMatrix = 1;
 
-	rect.extents.x1 = rect.extents.x2;
-	rect.extents.x2 = box.x2 + ss->xOffset;
+	opacity = MULTIPLY_USHORT (w->opacity, attrib->opacity);
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+	/* an opaque window has already been drawn in the solid pass and
+	   draws nothing in the translucent pass, its shadow can stay in
+	   the batch together with the shadows of the windows above it */
+	paints = (w->alpha || opacity != OPAQUE		||
+		  !(mask & PAINT_WINDOW_TRANSLUCENT_MASK) ||
+		  (mask & PAINT_WINDOW_TRANSFORMED_MASK));
 
-	/* right */
-	matrix->x0 = -((box.x2 - ss->size + ss->xOffset) * ss->dx);
-	matrix->xx = ss->dx;
+	if (w->alpha || opacity != OPAQUE)
+	    mask |= PAINT_WINDOW_TRANSLUCENT_MASK;
+	else
+	    mask |= PAINT_WINDOW_SOLID_MASK;
 
-	rect.extents.x1 = rect.extents.x2;
-	rect.extents.x2 = box.x2 + ss->size + ss->xOffset;
+	if (mask & PAINT_WINDOW_TRANSFORMED_MASK)
+	    region = &infiniteRegion;
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+	/* windows with deformed geometry go through the addWindowGeometry
+	   chain so the deformation applies to the shadow as well. the
+	   cached slices are clipped in screen coordinates which doesn't
+	   work for transformed windows either. */
+	cached = !w->deformed && !(mask & PAINT_WINDOW_TRANSFORMED_MASK);
 
-	/* bottom left */
-	matrix->yy = ss->dy;
-	matrix->x0 = -((box.x1 - ss->size + ss->xOffset) * ss->dx);
-	matrix->y0 = -((box.y2 - ss->size + ss->yOffset) * ss->dy);
+	target  = ss->target;
+	texture = ss->texture;
 
-	rect.extents.x1 = box.x1 - ss->size + ss->xOffset;
-	rect.extents.y1 = rect.extents.y2;
-	rect.extents.x2 = rect.extents.x1 + ss->size;
-	rect.extents.y2 = box.y2 + ss->size + ss->yOffset;
+	if (ss->opt[SHADOW_SCREEN_OPTION_SHAPED].value.b)
+	{
+	    SHADOW_WINDOW (w);
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+	    cached = FALSE;
+	    draw   = shadowAddShapedGeometry (w, matrix, region);
 
-	/* bottom */
-	matrix->xx = 0.0f;
-	matrix->x0 = ss->dx * ss->size;
+	    target  = sw->maskTarget;
+	    texture = sw->maskTexture;
+	}
+	else
+	{
+	    if (w->alpha &&
+		w->screen->textureEnvCombine &&
+		w->screen->maxTextureUnits > 1)
+	    {
+		if (!w->pixmap)
+		    bindWindow (w);
 
-	rect.extents.x1 = rect.extents.x2;
-	rect.extents.x2 = box.x2 + ss->xOffset;
+		matrix[1] = w->texture.matrix;
+		matrix[1].x0 -= ((w->attrib.x + ss->xOffset) * w->matrix.xx);
+		matrix[1].y0 -= ((w->attrib.y + ss->yOffset) * w->matrix.yy);
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+		nMatrix++;
+	    }
 
-	/* bottom right */
-	matrix->x0 = -((box.x2 - ss->size + ss->xOffset) * ss->dx);
-	matrix->xx = ss->dx;
+	    if (cached)
+	    {
+		SHADOW_WINDOW (w);
+
+		shadowValidateGeometry (w, matrix, nMatrix);
+
+		draw = (sw->vCount			   &&
+			region->extents.x1 < sw->bounds.x2 &&
+			region->extents.x2 > sw->bounds.x1 &&
+			region->extents.y1 < sw->bounds.y2 &&
+			region->extents.y2 > sw->bounds.y1);
+
+		/* shadows that only use the shadow texture can be batched,
+		   the batch is drawn with X coordinates of the untransformed
+		   screen */
+		if (draw && nMatrix == 1 &&
+		    !(mask & PAINT_WINDOW_ON_TRANSFORMED_SCREEN_MASK))
+		{
+		    shadowBatchGeometry (w, region, opacity);
+		    draw = FALSE;
+		}
+	    }
+	    else
+	    {
+		w->vCount = 0;
 
-	rect.extents.x1 = rect.extents.x2;
-	rect.extents.x2 = box.x2 + ss->size + ss->xOffset;
+		shadowAddGeometry (w, matrix, nMatrix, region, NULL);
 
-	(*w->screen->addWindowGeometry) (w, matrix, nMatrix, &rect, region);
+		draw = (w->vCount > 0);
+	    }
+	}
 
-	if (w->vCount)
+	if (draw)
 	{
+	    if (ss->batchCount)
+		shadowFlushBatch (w->screen);
+
 	    glEnable (GL_BLEND);
 
 	    glPushMatrix ();
@@ -722,8 +1836,8 @@ shadowPaintWindow (CompWindow		   *w,
 		glTranslatef (-w->attrib.x, -w->attrib.y, 0.0f);
 	    }
 
-	    glEnable (ss->target);
-	    glBindTexture (ss->target, ss->texture);
+	    glEnable (target);
+	    glBindTexture (target, texture);
 
 	    glColor4us (0x0, 0x0, 0x0, opacity);
 	    glTexEnvf (GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
@@ -750,7 +1864,15 @@ shadowPaintWindow (CompWindow		   *w,
 		glTexEnvf (GL_TEXTURE_ENV, GL_OPERAND1_ALPHA, GL_SRC_ALPHA);
 	    }
 
-	    (*w->screen->drawWindowGeometry) (w);
+	    /* the region is the whole screen when painting on a
+	       transformed screen and window coordinates don't map to
+	       screen pixels so no scissor is needed or possible */
+	    if (cached)
+		shadowDrawGeometry (w, region,
+				    !(mask &
+				      PAINT_WINDOW_ON_TRANSFORMED_SCREEN_MASK));
+	    else
+		(*w->screen->drawWindowGeometry) (w);
 
 	    if (nMatrix > 1)
 	    {
@@ -758,8 +1880,8 @@ shadowPaintWindow (CompWindow		   *w,
 		w->screen->activeTexture (GL_TEXTURE0_ARB);
 	    }
 
-	    glBindTexture (ss->target, 0);
-	    glDisable (ss->target);
+	    glBindTexture (target, 0);
+	    glDisable (target);
 
 	    glPopMatrix ();
 
@@ -769,6 +1891,10 @@ shadowPaintWindow (CompWindow		   *w,
 
 	    w->vCount = 0;
 	}
+
+	/* pending shadows go below anything drawn for this window */
+	if (ss->batchCount && paints)
+	    shadowFlushBatch (w->screen);
     }
 
     UNWRAP (ss, w->screen, paintWindow);
@@ -823,7 +1949,22 @@ shadowInitScreen (CompPlugin *p,
     if (!ss)
 	return FALSE;
 
+    ss->windowPrivateIndex =
+	allocateSizedWindowPrivateIndex (s, sizeof (ShadowWindow));
+    if (ss->windowPrivateIndex < 0)
+    {
+	free (ss);
+	return FALSE;
+    }
+
     ss->texture = 0;
+    ss->nCache  = 0;
+    ss->serial  = 0;
+
+    ss->batchVertices = NULL;
+    ss->batchColors   = NULL;
+    ss->batchSize     = 0;
+    ss->batchCount    = 0;
 
     ss->expand  = SHADOW_EXPAND_DEFAULT;
     ss->xOffset = SHADOW_OFFSET_X_DEFAULT;
@@ -831,7 +1972,9 @@ shadowInitScreen (CompPlugin *p,
 
     shadowScreenInitOptions (ss);
 
+    WRAP (ss, s, paintScreen, shadowPaintScreen);
     WRAP (ss, s, paintWindow, shadowPaintWindow);
+    WRAP (ss, s, drawWindowGeometry, shadowDrawWindowGeometry);
     WRAP (ss, s, damageWindowRect, shadowDamageWindowRect);
     WRAP (ss, s, damageWindowRegion, shadowDamageWindowRegion);
 
@@ -850,16 +1993,70 @@ shadowFiniScreen (CompPlugin *p,
 {
     SHADOW_SCREEN (s);
 
+    while (ss->nCache)
+	free (ss->cache[--ss->nCache].data);
+
     if (ss->texture)
 	glDeleteTextures (1, &ss->texture);
 
+    if (ss->batchVertices)
+	free (ss->batchVertices);
+
+    if (ss->batchColors)
+	free (ss->batchColors);
+
+    freeWindowPrivateIndex (s, ss->windowPrivateIndex);
+
+    UNWRAP (ss, s, paintScreen);
     UNWRAP (ss, s, paintWindow);
+    UNWRAP (ss, s, drawWindowGeometry);
     UNWRAP (ss, s, damageWindowRect);
     UNWRAP (ss, s, damageWindowRegion);
 
     free (ss);
 }
 
+static Bool
+shadowInitWindow (CompPlugin *p,
+		  CompWindow *w)
+{
+    ShadowWindow *sw;
+
+    SHADOW_SCREEN (w->screen);
+
+    sw = GET_SHADOW_WINDOW (w, ss);
+
+    /* serial never matches so geometry is built on first paint */
+    sw->serial  = ss->serial - 1;
+    sw->nMatrix = 0;
+    sw->vCount  = 0;
+
+    sw->maskTexture = 0;
+    sw->maskRects   = NULL;
+    sw->maskNRects  = 0;
+
+    sw->alphaDamaged = FALSE;
+    sw->alphaTimeout = 0;
+
+    return TRUE;
+}
+
+static void
+shadowFiniWindow (CompPlugin *p,
+		  CompWindow *w)
+{
+    SHADOW_WINDOW (w);
+
+    if (sw->alphaTimeout)
+	compRemoveTimeout (sw->alphaTimeout);
+
+    if (sw->maskTexture)
+	glDeleteTextures (1, &sw->maskTexture);
+
+    if (sw->maskRects)
+	free (sw->maskRects);
+}
+
 static Bool
 shadowInit (CompPlugin *p)
 {
@@ -887,8 +2084,8 @@ static CompPluginVTable shadowVTable = {
     shadowFiniDisplay,
     shadowInitScreen,
     shadowFiniScreen,
-    0, /* InitWindow */
-    0, /* FiniWindow */
+    shadowInitWindow,
+    shadowFiniWindow,
     0, /* GetDisplayOptions */
     0, /* SetDisplayOption */
     shadowGetScreenOptions,
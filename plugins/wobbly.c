@@ -33,41 +33,49 @@
 
 #include <comp.h>
 
-#define GRID_WIDTH  4
-#define GRID_HEIGHT 4
-
-#define MODEL_MAX_SPRINGS (GRID_WIDTH * GRID_HEIGHT * 2)
+#if defined (__GNUC__) && (defined (__i386__) || defined (__x86_64__))
+#define WOBBLY_SSE
+#include <cpuid.h>
+#include <xmmintrin.h>
+#endif
 
 typedef struct _xy_pair {
     float x, y;
 } Point, Vector;
 
-typedef struct _Object {
-    Vector force;
-    Point  position;
-    Vector velocity;
-    float  theta;
-    Bool   immobile;
-} Object;
+/* the objects of a model are stored one array per component so that a
+   step runs over contiguous floats, every object keeps the spring to
+   its right and lower neighbour. each array has a grid row of unused
+   zero floats before and after it so neighbours can be read without
+   checking for the edges. */
+typedef struct _Model {
+    float  *data;
+    float  *px, *py;
+    float  *vx, *vy;
 
-typedef struct _Spring {
-    Object *a;
-    Object *b;
-    Vector offset;
-} Spring;
+    /* zero for immobile objects */
+    float  *mobile;
+
+    /* spring offsets, k is zero where there is no spring */
+    float  *hox, *hoy, *hk;
+    float  *vox, *voy, *vk;
+
+    /* forces of those springs on the object they start from */
+    float  *hdx, *hdy;
+    float  *vdx, *vdy;
 
-typedef struct _Model {
-    Object *objects;
     int    numObjects;
-    Spring springs[MODEL_MAX_SPRINGS];
-    int    numSprings;
-    Object *anchorObject;
+    int    gridWidth;
+    int    gridHeight;
+    int    anchorObject;
     float  steps;
     Vector translate;
     Vector scale;
     Bool   transformed;
 } Model;
 
+#define MODEL_ARRAYS 15
+
 #define WOBBLY_FRICTION_DEFAULT    2.5f
 #define WOBBLY_FRICTION_MIN        0.1f
 #define WOBBLY_FRICTION_MAX       10.0f
@@ -86,6 +94,14 @@ typedef struct _Model {
 #define WOBBLY_MIN_GRID_SIZE_MIN      4
 #define WOBBLY_MIN_GRID_SIZE_MAX      128
 
+#define WOBBLY_MODEL_SIZE_DEFAULT 4
+#define WOBBLY_MODEL_SIZE_MIN     3
+#define WOBBLY_MODEL_SIZE_MAX     8
+
+/* a long frame is stepped at most this many times, the remaining time
+   only damps the model */
+#define WOBBLY_MAX_STEPS 4
+
 typedef enum {
     WobblyEffectNone = 0,
     WobblyEffectExplode,
@@ -122,7 +138,8 @@ typedef struct _WobblyDisplay {
 #define WOBBLY_SCREEN_OPTION_MIN_GRID_SIZE   3
 #define WOBBLY_SCREEN_OPTION_MAP_EFFECT      4
 #define WOBBLY_SCREEN_OPTION_FOCUS_EFFECT    5
-#define WOBBLY_SCREEN_OPTION_NUM             6
+#define WOBBLY_SCREEN_OPTION_MODEL_SIZE      6
+#define WOBBLY_SCREEN_OPTION_NUM             7
 
 typedef struct _WobblyScreen {
     int			     windowPrivateIndex;
@@ -139,13 +156,46 @@ typedef struct _WobblyScreen {
 
     Bool wobblyWindows;
 
+    float *basis;
+    int   basisSize;
+
     WobblyEffect mapEffect;
     WobblyEffect focusEffect;
 } WobblyScreen;
 
+/* vertex and index count after each clip rectangle's grid, the
+   indices only have to be rewritten when the shape of a grid changes */
+typedef struct _WobblyGridShape {
+    int width;
+    int height;
+    int nVertices;
+    int nIndices;
+} WobblyGridShape;
+
+/* the grids of one geometry pass and their indices. the shadow and the
+   window are separate passes with different grids, each pass picks the
+   list that holds its sequence of shapes so they don't evict each other */
+typedef struct _WobblyIndexList {
+    WobblyGridShape *shapes;
+    int		    nShapes;
+    int		    shapeSize;
+    GLuint	    *indices;
+    int		    indexSize;
+    unsigned int    used;
+} WobblyIndexList;
+
+#define WOBBLY_INDEX_LISTS 4
+
 typedef struct _WobblyWindow {
-    Model *model;
-    Bool  wobbly;
+    Model	    *model;
+    Bool	    wobbly;
+    BoxRec	    bounds;
+    BoxRec	    painted;
+    float	    u1, v1, u2, v2;
+    WobblyIndexList lists[WOBBLY_INDEX_LISTS];
+    int		    list;
+    int		    shape;
+    unsigned int    passes;
 } WobblyWindow;
 
 #define GET_WOBBLY_DISPLAY(d)				       \
@@ -170,6 +220,18 @@ typedef struct _WobblyWindow {
 
 #define NUM_OPTIONS(s) (sizeof ((s)->opt) / sizeof (CompOption))
 
+/* a window that isn't wobbling is painted in its own region and its
+   geometry doesn't reach outside the window until it's drawn again */
+static void
+wobblyResetBounds (WobblyWindow *ww)
+{
+    ww->bounds.x1  = ww->bounds.x2  = 0;
+    ww->painted.x1 = ww->painted.x2 = 0;
+
+    ww->u1 = ww->v1 = 0.0f;
+    ww->u2 = ww->v2 = 1.0f;
+}
+
 static CompOption *
 wobblyGetScreenOptions (CompScreen *screen,
 			int	   *count)
@@ -180,6 +242,42 @@ wobblyGetScreenOptions (CompScreen *screen,
     return ws->opt;
 }
 
+static void
+destroyModel (Model *model)
+{
+    free (model->data);
+    free (model);
+}
+
+/* models are recreated with the new grid size when they're needed */
+static void
+wobblyResetModels (CompScreen *s)
+{
+    WobblyWindow *ww;
+    CompWindow   *w;
+
+    WOBBLY_SCREEN (s);
+
+    for (w = s->windows; w; w = w->next)
+    {
+	if (!w->pluginsInitialized)
+	    continue;
+
+	ww = GET_WOBBLY_WINDOW (w, ws);
+	if (ww->model)
+	{
+	    destroyModel (ww->model);
+	    ww->model  = 0;
+	    ww->wobbly = FALSE;
+	    w->deformed = FALSE;
+
+	    wobblyResetBounds (ww);
+	}
+    }
+
+    damageScreen (s);
+}
+
 static Bool
 wobblySetScreenOption (CompScreen      *screen,
 		     char	     *name,
@@ -237,6 +335,13 @@ wobblySetScreenOption (CompScreen      *screen,
 		}
 	    }
 	}
+	break;
+    case WOBBLY_SCREEN_OPTION_MODEL_SIZE:
+	if (compSetIntOption (o, value))
+	{
+	    wobblyResetModels (screen);
+	    return TRUE;
+	}
     default:
 	break;
     }
@@ -304,54 +409,32 @@ wobblyScreenInitOptions (WobblyScreen *ws)
     o->value.s	      = strdup (WOBBLY_FOCUS_DEFAULT);
     o->rest.s.string  = effectName;
     o->rest.s.nString = NUM_EFFECT;
-}
 
-static void
-objectInit (Object *object,
-	    float  positionX,
-	    float  positionY,
-	    float  velocityX,
-	    float  velocityY)
-{
-    object->force.x = 0;
-    object->force.y = 0;
-
-    object->position.x = positionX;
-    object->position.y = positionY;
-
-    object->velocity.x = velocityX;
-    object->velocity.y = velocityY;
-
-    object->theta    = 0;
-    object->immobile = FALSE;
-}
-
-static void
-springInit (Spring *spring,
-	    Object *a,
-	    Object *b,
-	    float  offsetX,
-	    float  offsetY)
-{
-    spring->a = a;
-    spring->b = b;
-    spring->offset.x = offsetX;
-    spring->offset.y = offsetY;
+    o = &ws->opt[WOBBLY_SCREEN_OPTION_MODEL_SIZE];
+    o->name	  = "model_size";
+    o->shortDesc  = "Model Size";
+    o->longDesc	  = "Spring Model Grid Size";
+    o->type	  = CompOptionTypeInt;
+    o->value.i	  = WOBBLY_MODEL_SIZE_DEFAULT;
+    o->rest.i.min = WOBBLY_MODEL_SIZE_MIN;
+    o->rest.i.max = WOBBLY_MODEL_SIZE_MAX;
 }
 
 static void
-modelAddSpring (Model  *model,
-		Object *a,
-		Object *b,
-		float  offsetX,
-		float  offsetY)
+modelInitObject (Model *model,
+		 int   i,
+		 float positionX,
+		 float positionY,
+		 float velocityX,
+		 float velocityY)
 {
-    Spring *spring;
+    model->px[i] = positionX;
+    model->py[i] = positionY;
 
-    spring = &model->springs[model->numSprings];
-    model->numSprings++;
+    model->vx[i] = velocityX;
+    model->vy[i] = velocityY;
 
-    springInit (spring, a, b, offsetX, offsetY);
+    model->mobile[i] = 1.0f;
 }
 
 static void
@@ -362,24 +445,28 @@ modelSetMiddleAnchor (Model *model,
 		      int   height)
 {
     float w, h;
+    int   gridWidth, gridHeight;
 
-    if (model->anchorObject)
-	model->anchorObject->immobile = FALSE;
+    if (model->anchorObject >= 0)
+	model->mobile[model->anchorObject] = 1.0f;
 
     w = (float) width  * model->scale.x;
     h = (float) height * model->scale.y;
     x += model->translate.x;
     y += model->translate.y;
 
-    model->anchorObject = &model->objects[GRID_WIDTH *
-					  ((GRID_HEIGHT - 1) / 2) +
-					  (GRID_WIDTH - 1) / 2];
-    model->anchorObject->position.x = x +
-	((GRID_WIDTH - 1) / 2 * w) / (float) (GRID_WIDTH - 1);
-    model->anchorObject->position.y = y +
-	((GRID_HEIGHT - 1) / 2 * h) / (float) (GRID_HEIGHT - 1);
+    gridWidth  = model->gridWidth;
+    gridHeight = model->gridHeight;
+
+    model->anchorObject = gridWidth * ((gridHeight - 1) / 2) +
+	(gridWidth - 1) / 2;
 
-    model->anchorObject->immobile = TRUE;
+    model->px[model->anchorObject] = x +
+	((gridWidth - 1) / 2 * w) / (float) (gridWidth - 1);
+    model->py[model->anchorObject] = y +
+	((gridHeight - 1) / 2 * h) / (float) (gridHeight - 1);
+
+    model->mobile[model->anchorObject] = 0.0f;
 }
 
 static void
@@ -397,14 +484,14 @@ modelInitObjects (Model *model,
     x += model->translate.x;
     y += model->translate.y;
 
-    for (gridY = 0; gridY < GRID_HEIGHT; gridY++)
+    for (gridY = 0; gridY < model->gridHeight; gridY++)
     {
-	for (gridX = 0; gridX < GRID_WIDTH; gridX++)
+	for (gridX = 0; gridX < model->gridWidth; gridX++)
 	{
-	    objectInit (&model->objects[i],
-			x + (gridX * w) / (float) (GRID_WIDTH - 1),
-			y + (gridY * h) / (float) (GRID_HEIGHT - 1),
-			0, 0);
+	    modelInitObject (model, i,
+			     x + (gridX * w) / (float) (model->gridWidth - 1),
+			     y + (gridY * h) / (float) (model->gridHeight - 1),
+			     0, 0);
 	    i++;
 	}
     }
@@ -429,21 +516,21 @@ modelAdjustObjectsForExplosion (Model *model,
     x += model->translate.x;
     y += model->translate.y;
 
-    for (gridY = 0; gridY < GRID_HEIGHT; gridY++)
+    for (gridY = 0; gridY < model->gridHeight; gridY++)
     {
-	for (gridX = 0; gridX < GRID_WIDTH; gridX++)
+	for (gridX = 0; gridX < model->gridWidth; gridX++)
 	{
-	    if (!model->objects[i].immobile)
+	    if (model->mobile[i])
 	    {
 		scale = ((float) rand () * 0.1f) / RAND_MAX;
-		vX = (model->objects[i].position.x - (x + w / 2.0f)) * scale;
-		vY = (model->objects[i].position.y - (y + h / 2.0f)) * scale;
+		vX = (model->px[i] - (x + w / 2.0f)) * scale;
+		vY = (model->py[i] - (y + h / 2.0f)) * scale;
 
-		model->objects[i].position.x = x + w / 2.0f;
-		model->objects[i].position.y = y + h / 2.0f;
+		model->px[i] = x + w / 2.0f;
+		model->py[i] = y + h / 2.0f;
 
-		model->objects[i].velocity.x += vX;
-		model->objects[i].velocity.y += vY;
+		model->vx[i] += vX;
+		model->vy[i] += vY;
 	    }
 
 	    i++;
@@ -468,22 +555,22 @@ modelAdjustObjectsForShiver (Model *model,
     x += model->translate.x;
     y += model->translate.y;
 
-    for (gridY = 0; gridY < GRID_HEIGHT; gridY++)
+    for (gridY = 0; gridY < model->gridHeight; gridY++)
     {
-	for (gridX = 0; gridX < GRID_WIDTH; gridX++)
+	for (gridX = 0; gridX < model->gridWidth; gridX++)
 	{
-	    if (!model->objects[i].immobile)
+	    if (model->mobile[i])
 	    {
-		vX = model->objects[i].position.x - (x + w  / 2);
-		vY = model->objects[i].position.y - (y + h / 2);
+		vX = model->px[i] - (x + w  / 2);
+		vY = model->py[i] - (y + h / 2);
 
 		vX /= w;
 		vY /= h;
 
 		scale = ((float) rand () * 7.5f) / RAND_MAX;
 
-		model->objects[i].velocity.x += vX * scale;
-		model->objects[i].velocity.y += vY * scale;
+		model->vx[i] += vX * scale;
+		model->vy[i] += vY * scale;
 	    }
 
 	    i++;
@@ -502,29 +589,30 @@ modelInitSprings (Model *model,
     float hpad, vpad;
     float w, h;
 
-    model->numSprings = 0;
-
     w = (float) width  * model->scale.x;
     h = (float) height * model->scale.y;
 
-    hpad = w / (GRID_WIDTH - 1);
-    vpad = h / (GRID_HEIGHT - 1);
+    hpad = w / (model->gridWidth - 1);
+    vpad = h / (model->gridHeight - 1);
 
-    for (gridY = 0; gridY < GRID_HEIGHT; gridY++)
+    for (gridY = 0; gridY < model->gridHeight; gridY++)
     {
-	for (gridX = 0; gridX < GRID_WIDTH; gridX++)
+	for (gridX = 0; gridX < model->gridWidth; gridX++)
 	{
-	    if (gridX > 0)
-		modelAddSpring (model,
-				&model->objects[i - 1],
-				&model->objects[i],
-				hpad, 0);
-
-	    if (gridY > 0)
-		modelAddSpring (model,
-				&model->objects[i - GRID_WIDTH],
-				&model->objects[i],
-				0, vpad);
+	    model->hox[i] = model->hoy[i] = model->hk[i] = 0.0f;
+	    model->vox[i] = model->voy[i] = model->vk[i] = 0.0f;
+
+	    if (gridX < model->gridWidth - 1)
+	    {
+		model->hox[i] = hpad;
+		model->hk[i]  = 1.0f;
+	    }
+
+	    if (gridY < model->gridHeight - 1)
+	    {
+		model->voy[i] = vpad;
+		model->vk[i]  = 1.0f;
+	    }
 
 	    i++;
 	}
@@ -540,8 +628,8 @@ modelMove (Model *model,
 
     for (i = 0; i < model->numObjects; i++)
     {
-	model->objects[i].position.x += dx;
-	model->objects[i].position.y += dy;
+	model->px[i] += dx;
+	model->py[i] += dy;
     }
 }
 
@@ -549,21 +637,52 @@ static Model *
 createModel (int x,
 	     int y,
 	     int width,
-	     int height)
+	     int height,
+	     int gridWidth,
+	     int gridHeight)
 {
     Model *model;
+    float **arrays[MODEL_ARRAYS];
+    int   i, size;
 
     model = malloc (sizeof (Model));
     if (!model)
 	return 0;
 
-    model->numObjects = GRID_WIDTH * GRID_HEIGHT;
-    model->objects = malloc (sizeof (Object) * model->numObjects);
-    if (!model->objects)
+    model->gridWidth  = gridWidth;
+    model->gridHeight = gridHeight;
+
+    model->numObjects = gridWidth * gridHeight;
+
+    size = model->numObjects + 2 * gridWidth;
+
+    model->data = calloc (MODEL_ARRAYS * size, sizeof (float));
+    if (!model->data)
+    {
+	free (model);
 	return 0;
+    }
 
-    model->anchorObject = 0;
-    model->numSprings = 0;
+    arrays[0]  = &model->px;
+    arrays[1]  = &model->py;
+    arrays[2]  = &model->vx;
+    arrays[3]  = &model->vy;
+    arrays[4]  = &model->mobile;
+    arrays[5]  = &model->hox;
+    arrays[6]  = &model->hoy;
+    arrays[7]  = &model->hk;
+    arrays[8]  = &model->vox;
+    arrays[9]  = &model->voy;
+    arrays[10] = &model->vk;
+    arrays[11] = &model->hdx;
+    arrays[12] = &model->hdy;
+    arrays[13] = &model->vdx;
+    arrays[14] = &model->vdy;
+
+    for (i = 0; i < MODEL_ARRAYS; i++)
+	*arrays[i] = model->data + i * size + gridWidth;
+
+    model->anchorObject = -1;
 
     model->steps = 0;
 
@@ -581,131 +700,287 @@ createModel (int x,
     return model;
 }
 
-static void
-objectApplyForce (Object *object,
-		  float  fx,
-		  float  fy)
+/* returns the number of steps the model has to take and keeps the
+   remaining fraction of a step for the next frame. steps beyond
+   WOBBLY_MAX_STEPS are not simulated, the velocity of each object is
+   instead decayed by what friction alone would have taken away so a
+   stalled frame doesn't cost more to catch up with. */
+static int
+modelSteps (Model *model,
+	    float time,
+	    float friction)
 {
-    object->force.x += fx;
-    object->force.y += fy;
+    float damping;
+    int   steps, i;
+
+    model->steps += time / 15.0f;
+    steps = floor (model->steps);
+    model->steps -= steps;
+
+    if (steps > WOBBLY_MAX_STEPS)
+    {
+	damping = pow (1.0f - friction / 20.0f, steps - WOBBLY_MAX_STEPS);
+
+	for (i = 0; i < model->numObjects; i++)
+	{
+	    model->vx[i] *= damping;
+	    model->vy[i] *= damping;
+	}
+
+	steps = WOBBLY_MAX_STEPS;
+    }
+
+    return steps;
 }
 
+/* springs from each object in [i, n) to its right and lower neighbour,
+   k is half the spring constant as each spring pulls on both ends */
 static void
-springExertForces (Spring *spring,
-		   float  k)
+modelSpringsScalar (Model *model,
+		    float k,
+		    int	  i)
+{
+    float *px = model->px, *py = model->py;
+    float *hdx = model->hdx, *hdy = model->hdy;
+    float *vdx = model->vdx, *vdy = model->vdy;
+    float hk, vk;
+    int   gridWidth = model->gridWidth;
+    int   n = model->numObjects;
+
+    for (; i < n; i++)
+    {
+	hk = model->hk[i] * k;
+	vk = model->vk[i] * k;
+
+	hdx[i] = hk * (px[i + 1] - px[i] - model->hox[i]);
+	hdy[i] = hk * (py[i + 1] - py[i] - model->hoy[i]);
+
+	vdx[i] = vk * (px[i + gridWidth] - px[i] - model->vox[i]);
+	vdy[i] = vk * (py[i + gridWidth] - py[i] - model->voy[i]);
+    }
+}
+
+/* an object gets the force of its own springs and the opposite force
+   of the springs from its left and upper neighbour, returns the sum of
+   the speeds of the objects in [i, n) */
+static float
+modelIntegrateScalar (Model *model,
+		      float friction,
+		      int   i)
 {
-    Vector da, db;
-    Vector a, b;
+    float *px = model->px, *py = model->py;
+    float *vx = model->vx, *vy = model->vy;
+    float *hdx = model->hdx, *hdy = model->hdy;
+    float *vdx = model->vdx, *vdy = model->vdy;
+    float *mobile = model->mobile;
+    float fx, fy, speed = 0.0f;
+    int   gridWidth = model->gridWidth;
+    int   n = model->numObjects;
+
+    for (; i < n; i++)
+    {
+	fx = hdx[i] - hdx[i - 1] + vdx[i] - vdx[i - gridWidth];
+	fy = hdy[i] - hdy[i - 1] + vdy[i] - vdy[i - gridWidth];
 
-    a = spring->a->position;
-    b = spring->b->position;
+	fx -= friction * vx[i];
+	fy -= friction * vy[i];
 
-    da.x = 0.5f * (b.x - a.x - spring->offset.x);
-    da.y = 0.5f * (b.y - a.y - spring->offset.y);
+	/* immobile objects have their velocity cleared */
+	vx[i] = mobile[i] * (vx[i] + fx / 20.0f);
+	vy[i] = mobile[i] * (vy[i] + fy / 20.0f);
 
-    db.x = 0.5f * (a.x - b.x + spring->offset.x);
-    db.y = 0.5f * (a.y - b.y + spring->offset.y);
+	px[i] += vx[i];
+	py[i] += vy[i];
 
-    objectApplyForce (spring->a, k * da.x, k * da.y);
-    objectApplyForce (spring->b, k * db.x, k * db.y);
+	speed += fabs (vx[i]) + fabs (vy[i]);
+    }
+
+    return speed;
 }
 
 static float
-modelStepObject (Model  *model,
-		 Object *object,
-		 float  friction)
+modelStepScalar (Model *model,
+		 float friction,
+		 float k)
 {
-    object->theta += 0.05f;
+    modelSpringsScalar (model, k, 0);
+
+    return modelIntegrateScalar (model, friction, 0);
+}
+
+typedef float (*ModelStepProc) (Model *model,
+				float friction,
+				float k);
 
-    object->force.x -= friction * object->velocity.x;
-    object->force.y -= friction * object->velocity.y;
+#ifdef WOBBLY_SSE
 
-    if (object->immobile)
+/* four objects at a time, the remainder goes through the scalar loops */
+static float __attribute__ ((target ("sse")))
+modelStepSse (Model *model,
+	      float friction,
+	      float k)
+{
+    __m128 vk = _mm_set1_ps (k);
+    __m128 f = _mm_set1_ps (friction);
+    __m128 twenty = _mm_set1_ps (20.0f);
+    __m128 sign = _mm_set1_ps (-0.0f);
+    __m128 speed = _mm_setzero_ps ();
+    __m128 x, y, hk, vk2, fx, fy, mobile;
+    float  sum[4];
+    int	   gridWidth = model->gridWidth;
+    int	   n = model->numObjects;
+    int	   i;
+
+    for (i = 0; n - i >= 4; i += 4)
     {
-	object->velocity.x = 0.0f;
-	object->velocity.y = 0.0f;
+	x = _mm_loadu_ps (model->px + i);
+	y = _mm_loadu_ps (model->py + i);
+
+	hk  = _mm_mul_ps (_mm_loadu_ps (model->hk + i), vk);
+	vk2 = _mm_mul_ps (_mm_loadu_ps (model->vk + i), vk);
+
+	fx = _mm_sub_ps (_mm_loadu_ps (model->px + i + 1), x);
+	fy = _mm_sub_ps (_mm_loadu_ps (model->py + i + 1), y);
+	fx = _mm_sub_ps (fx, _mm_loadu_ps (model->hox + i));
+	fy = _mm_sub_ps (fy, _mm_loadu_ps (model->hoy + i));
+
+	_mm_storeu_ps (model->hdx + i, _mm_mul_ps (hk, fx));
+	_mm_storeu_ps (model->hdy + i, _mm_mul_ps (hk, fy));
+
+	fx = _mm_sub_ps (_mm_loadu_ps (model->px + i + gridWidth), x);
+	fy = _mm_sub_ps (_mm_loadu_ps (model->py + i + gridWidth), y);
+	fx = _mm_sub_ps (fx, _mm_loadu_ps (model->vox + i));
+	fy = _mm_sub_ps (fy, _mm_loadu_ps (model->voy + i));
+
+	_mm_storeu_ps (model->vdx + i, _mm_mul_ps (vk2, fx));
+	_mm_storeu_ps (model->vdy + i, _mm_mul_ps (vk2, fy));
     }
-    else
+
+    modelSpringsScalar (model, k, i);
+
+    for (i = 0; n - i >= 4; i += 4)
     {
-	object->velocity.x += object->force.x / 20.0f;
-	object->velocity.y += object->force.y / 20.0f;
+	fx = _mm_sub_ps (_mm_loadu_ps (model->hdx + i),
+			 _mm_loadu_ps (model->hdx + i - 1));
+	fx = _mm_add_ps (fx, _mm_loadu_ps (model->vdx + i));
+	fx = _mm_sub_ps (fx, _mm_loadu_ps (model->vdx + i - gridWidth));
+
+	fy = _mm_sub_ps (_mm_loadu_ps (model->hdy + i),
+			 _mm_loadu_ps (model->hdy + i - 1));
+	fy = _mm_add_ps (fy, _mm_loadu_ps (model->vdy + i));
+	fy = _mm_sub_ps (fy, _mm_loadu_ps (model->vdy + i - gridWidth));
 
-	object->position.x += object->velocity.x;
-	object->position.y += object->velocity.y;
+	x = _mm_loadu_ps (model->vx + i);
+	y = _mm_loadu_ps (model->vy + i);
+
+	fx = _mm_sub_ps (fx, _mm_mul_ps (f, x));
+	fy = _mm_sub_ps (fy, _mm_mul_ps (f, y));
+
+	mobile = _mm_loadu_ps (model->mobile + i);
+
+	x = _mm_mul_ps (mobile, _mm_add_ps (x, _mm_div_ps (fx, twenty)));
+	y = _mm_mul_ps (mobile, _mm_add_ps (y, _mm_div_ps (fy, twenty)));
+
+	_mm_storeu_ps (model->vx + i, x);
+	_mm_storeu_ps (model->vy + i, y);
+
+	_mm_storeu_ps (model->px + i,
+		       _mm_add_ps (_mm_loadu_ps (model->px + i), x));
+	_mm_storeu_ps (model->py + i,
+		       _mm_add_ps (_mm_loadu_ps (model->py + i), y));
+
+	speed = _mm_add_ps (speed, _mm_andnot_ps (sign, x));
+	speed = _mm_add_ps (speed, _mm_andnot_ps (sign, y));
     }
 
-    object->force.x = 0.0f;
-    object->force.y = 0.0f;
+    _mm_storeu_ps (sum, speed);
 
-    return fabs (object->velocity.x) + fabs (object->velocity.y);
+    return sum[0] + sum[1] + sum[2] + sum[3] +
+	modelIntegrateScalar (model, friction, i);
 }
 
-static Bool
-modelStep (Model *model,
-	   float friction,
-	   float k,
-	   float time)
+static ModelStepProc
+chooseModelStep (void)
 {
-    int   i, j, steps;
-    float velocitySum = 0.0f;
+    unsigned int eax, ebx, ecx, edx;
 
-    model->steps += time / 15.0f;
-    steps = floor (model->steps);
-    model->steps -= steps;
+    if (__get_cpuid (1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE))
+	return modelStepSse;
 
-    if (!steps)
-	return TRUE;
+    return modelStepScalar;
+}
 
-    for (j = 0; j < steps; j++)
-    {
-	for (i = 0; i < model->numSprings; i++)
-	    springExertForces (&model->springs[i], k);
+#else
 
-	for (i = 0; i < model->numObjects; i++)
-	    velocitySum += modelStepObject (model,
-					    &model->objects[i],
-					    friction);
-    }
+static ModelStepProc
+chooseModelStep (void)
+{
+    return modelStepScalar;
+}
 
-    return (velocitySum > 0.5f);
+#endif
+
+/* returns the sum of the speeds of all objects over all steps */
+static float
+modelStep (Model *model,
+	   int	 steps,
+	   float friction,
+	   float k)
+{
+    static ModelStepProc step = NULL;
+    float		 velocity = 0.0f;
+
+    if (!step)
+	step = chooseModelStep ();
+
+    while (steps--)
+	velocity += (*step) (model, friction, 0.5f * k);
+
+    return velocity;
 }
 
+/* the objects of the grid are the control points of a single bezier
+   surface with one degree less than the grid size in each direction */
 static void
-bezierPatchEvaluate (Model *model,
-		     float u,
-		     float v,
-		     float *patchX,
-		     float *patchY)
+bernsteinCoefficients (float u,
+		       int   n,
+		       float *coeffs)
 {
-    float coeffsU[4], coeffsV[4];
-    float x, y;
+    float c = 1.0f;
     int   i, j;
 
-    coeffsU[0] = (1 - u) * (1 - u) * (1 - u);
-    coeffsU[1] = 3 * u * (1 - u) * (1 - u);
-    coeffsU[2] = 3 * u * u * (1 - u);
-    coeffsU[3] = u * u * u;
+    for (i = 0; i < n; i++)
+    {
+	coeffs[i] = c;
+
+	/* binomial coefficient for the next term */
+	c = c * (n - 1 - i) / (i + 1);
 
-    coeffsV[0] = (1 - v) * (1 - v) * (1 - v);
-    coeffsV[1] = 3 * v * (1 - v) * (1 - v);
-    coeffsV[2] = 3 * v * v * (1 - v);
-    coeffsV[3] = v * v * v;
+	for (j = 0; j < i; j++)
+	    coeffs[i] *= u;
 
-    x = y = 0.0f;
+	for (j = i; j < n - 1; j++)
+	    coeffs[i] *= 1 - u;
+    }
+}
 
-    for (i = 0; i < 4; i++)
+static Bool
+wobblyEnsureBasis (WobblyScreen *ws,
+		   int		size)
+{
+    if (size > ws->basisSize)
     {
-	for (j = 0; j < 4; j++)
-	{
-	    x += coeffsU[i] * coeffsV[j] *
-		model->objects[j * GRID_WIDTH + i].position.x;
-	    y += coeffsU[i] * coeffsV[j] *
-		model->objects[j * GRID_WIDTH + i].position.y;
-	}
+	float *basis;
+
+	basis = realloc (ws->basis, sizeof (float) * size);
+	if (!basis)
+	    return FALSE;
+
+	ws->basis     = basis;
+	ws->basisSize = size;
     }
 
-    *patchX = x;
-    *patchY = y;
+    return TRUE;
 }
 
 static Bool
@@ -715,8 +990,12 @@ wobblyEnsureModel (CompWindow *w)
 
     if (!ww->model)
     {
+	WOBBLY_SCREEN (w->screen);
+
 	ww->model = createModel (w->attrib.x, w->attrib.y,
-				 w->width, w->height);
+				 w->width, w->height,
+				 ws->opt[WOBBLY_SCREEN_OPTION_MODEL_SIZE].value.i,
+				 ws->opt[WOBBLY_SCREEN_OPTION_MODEL_SIZE].value.i);
 	if (!ww->model)
 	    return FALSE;
     }
@@ -725,40 +1004,176 @@ wobblyEnsureModel (CompWindow *w)
 }
 
 static float
-objectDistance (Object *object,
-		float  x,
-		float  y)
+objectDistance (Model *model,
+		int   object,
+		float x,
+		float y)
 {
     float dx, dy;
 
-    dx = object->position.x - x;
-    dy = object->position.y - y;
+    dx = model->px[object] - x;
+    dy = model->py[object] - y;
 
     return sqrt (dx * dx + dy * dy);
 }
 
-static Object *
+static int
 modelFindNearestObject (Model *model,
 			float x,
 			float y)
 {
-    Object *object = &model->objects[0];
-    float  distance, minDistance = 0.0;
-    int    i;
+    float distance, minDistance = 0.0;
+    int   i, object = 0;
 
     for (i = 0; i < model->numObjects; i++)
     {
-	distance = objectDistance (&model->objects[i], x, y);
+	distance = objectDistance (model, i, x, y);
 	if (i == 0 || distance < minDistance)
 	{
 	    minDistance = distance;
-	    object = &model->objects[i];
+	    object = i;
 	}
     }
 
     return object;
 }
 
+/* control points of the segment [t1, t2] of a bezier curve, each one
+   is the blossom of the curve with some of its arguments at t1 and the
+   rest at t2 */
+static void
+bezierSegment (float *p,
+	       int   n,
+	       int   stride,
+	       float t1,
+	       float t2,
+	       float *out)
+{
+    float tmp[WOBBLY_MODEL_SIZE_MAX];
+    float t;
+    int   i, j, k;
+
+    for (i = 0; i < n; i++)
+    {
+	for (j = 0; j < n; j++)
+	    tmp[j] = p[j * stride];
+
+	for (k = 0; k < n - 1; k++)
+	{
+	    t = (k < n - 1 - i) ? t1 : t2;
+
+	    for (j = 0; j < n - 1 - k; j++)
+		tmp[j] += t * (tmp[j + 1] - tmp[j]);
+	}
+
+	out[i * stride] = tmp[0];
+    }
+}
+
+/* the bezier surface lies within the convex hull of its control
+   points. geometry outside the window, like shadows, is evaluated
+   beyond [0, 1] so the hull is taken of the control points of the
+   surface over the parameter range that was actually drawn */
+static void
+modelBounds (Model  *model,
+	     float  u1,
+	     float  v1,
+	     float  u2,
+	     float  v2,
+	     BoxPtr box)
+{
+    float px[WOBBLY_MODEL_SIZE_MAX * WOBBLY_MODEL_SIZE_MAX];
+    float py[WOBBLY_MODEL_SIZE_MAX * WOBBLY_MODEL_SIZE_MAX];
+    float qx[WOBBLY_MODEL_SIZE_MAX * WOBBLY_MODEL_SIZE_MAX];
+    float qy[WOBBLY_MODEL_SIZE_MAX * WOBBLY_MODEL_SIZE_MAX];
+    float x1, y1, x2, y2;
+    int   gw = model->gridWidth;
+    int   gh = model->gridHeight;
+    int   i;
+
+    for (i = 0; i < model->numObjects; i++)
+    {
+	px[i] = model->px[i];
+	py[i] = model->py[i];
+    }
+
+    for (i = 0; i < gh; i++)
+    {
+	bezierSegment (px + i * gw, gw, 1, u1, u2, qx + i * gw);
+	bezierSegment (py + i * gw, gw, 1, u1, u2, qy + i * gw);
+    }
+
+    for (i = 0; i < gw; i++)
+    {
+	bezierSegment (qx + i, gh, gw, v1, v2, px + i);
+	bezierSegment (qy + i, gh, gw, v1, v2, py + i);
+    }
+
+    x1 = y1 = MAXSHORT;
+    x2 = y2 = MINSHORT;
+
+    for (i = 0; i < model->numObjects; i++)
+    {
+	x1 = MIN (x1, px[i]);
+	y1 = MIN (y1, py[i]);
+	x2 = MAX (x2, px[i]);
+	y2 = MAX (y2, py[i]);
+    }
+
+    /* one pixel of padding for filtering */
+    box->x1 = floor (x1) - 1;
+    box->y1 = floor (y1) - 1;
+    box->x2 = ceil (x2) + 1;
+    box->y2 = ceil (y2) + 1;
+}
+
+/* damages the area covered by the window in the last frame and in the
+   current state of the model. the damage goes through
+   damageWindowRegion so plugins can add what they draw around the
+   window, like shadows. */
+static void
+wobblyDamageWindow (CompWindow *w)
+{
+    REGION region;
+    BoxRec box;
+
+    WOBBLY_WINDOW (w);
+
+    region.rects = &region.extents;
+    region.numRects = region.size = 1;
+
+    /* a window that wasn't wobbling was painted in its own region */
+    if (ww->bounds.x1 < ww->bounds.x2)
+	region.extents = ww->bounds;
+    else
+	region.extents = w->region->extents;
+
+    /* what was drawn since the last damage has to be cleared, the hull
+       only bounds it when the geometry stays inside the parameter
+       range the hull was taken of */
+    if (ww->painted.x1 < ww->painted.x2)
+    {
+	region.extents.x1 = MIN (region.extents.x1, ww->painted.x1);
+	region.extents.y1 = MIN (region.extents.y1, ww->painted.y1);
+	region.extents.x2 = MAX (region.extents.x2, ww->painted.x2);
+	region.extents.y2 = MAX (region.extents.y2, ww->painted.y2);
+
+	ww->painted.x1 = ww->painted.x2 = 0;
+    }
+
+    modelBounds (ww->model, ww->u1, ww->v1, ww->u2, ww->v2, &box);
+
+    region.extents.x1 = MIN (region.extents.x1, box.x1);
+    region.extents.y1 = MIN (region.extents.y1, box.y1);
+    region.extents.x2 = MAX (region.extents.x2, box.x2);
+    region.extents.y2 = MAX (region.extents.y2, box.y2);
+
+    ww->bounds = box;
+
+    if (!(*w->screen->damageWindowRegion) (w, &region))
+	damageScreenRegion (w->screen, &region);
+}
+
 static void
 wobblyMoveWindow (CompWindow *w,
 		  int	     dx,
@@ -780,7 +1195,7 @@ wobblyMoveWindow (CompWindow *w,
 	XQueryPointer (w->screen->display->display, w->screen->root,
 		       &win, &win, &x, &y, &i, &i, &ui);
 
-	ww->model->anchorObject->immobile = FALSE;
+	ww->model->mobile[ww->model->anchorObject] = 1.0f;
 
 	if (x < w->attrib.x || x > w->attrib.x + w->width ||
 	    y < w->attrib.y || y > w->attrib.y + w->height)
@@ -790,15 +1205,16 @@ wobblyMoveWindow (CompWindow *w,
 	}
 
 	ww->model->anchorObject = modelFindNearestObject (ww->model, x, y);
-	ww->model->anchorObject->immobile = TRUE;
+	ww->model->mobile[ww->model->anchorObject] = 0.0f;
 
 	ww->wobbly = ws->wobblyWindows = TRUE;
+	w->deformed = TRUE;
     }
 
-    ww->model->anchorObject->position.x += dx;
-    ww->model->anchorObject->position.y += dy;
+    ww->model->px[ww->model->anchorObject] += dx;
+    ww->model->py[ww->model->anchorObject] += dy;
 
-    damageScreen (w->screen);
+    wobblyDamageWindow (w);
 }
 
 static Bool
@@ -828,6 +1244,8 @@ wobblyPreparePaintScreen (CompScreen *s,
 {
     WobblyWindow *ww;
     CompWindow   *w;
+    float	 velocity;
+    int		 i, steps;
 
     WOBBLY_SCREEN (s);
 
@@ -839,24 +1257,57 @@ wobblyPreparePaintScreen (CompScreen *s,
 	springK  = ws->opt[WOBBLY_SCREEN_OPTION_SPRING_K].value.f;
 
 	ws->wobblyWindows = FALSE;
-	for (w = s->windows; w; w = w->next)
+	for (i = 0; i < s->nStack; i++)
 	{
+	    w = s->stack[i];
+
+	    if (!w->pluginsInitialized)
+		continue;
+
 	    ww = GET_WOBBLY_WINDOW (w, ws);
 
-	    if (ww->wobbly)
+	    if (!ww->wobbly)
+		continue;
+
+	    if (w->attrib.map_state == IsViewable)
 	    {
-		if (w->attrib.map_state == IsViewable &&
-		    modelStep (ww->model, friction, springK, msSinceLastPaint))
+		/* models that don't step this frame keep wobbling */
+		steps = modelSteps (ww->model, msSinceLastPaint, friction);
+		if (!steps)
 		{
 		    ws->wobblyWindows = TRUE;
+		    continue;
 		}
-		else
+
+		velocity = modelStep (ww->model, steps, friction, springK);
+
+		wobblyDamageWindow (w);
+
+		if (velocity > 0.5f)
 		{
-		    modelSetMiddleAnchor (ww->model,
-					  w->attrib.x, w->attrib.y,
-					  w->width, w->height);
-		    ww->wobbly = FALSE;
+		    ws->wobblyWindows = TRUE;
+		    continue;
 		}
+
+		modelSetMiddleAnchor (ww->model,
+				      w->attrib.x, w->attrib.y,
+				      w->width, w->height);
+		ww->wobbly = FALSE;
+		w->deformed = FALSE;
+
+		/* the window is painted in its own region again */
+		wobblyResetBounds (ww);
+		addWindowDamage (w);
+	    }
+	    else
+	    {
+		modelSetMiddleAnchor (ww->model,
+				      w->attrib.x, w->attrib.y,
+				      w->width, w->height);
+		ww->wobbly = FALSE;
+		w->deformed = FALSE;
+
+		wobblyResetBounds (ww);
 	    }
 	}
     }
@@ -871,8 +1322,18 @@ wobblyDonePaintScreen (CompScreen *s)
 {
     WOBBLY_SCREEN (s);
 
+    /* keeps frames coming while windows wobble, windows that started
+       wobbling while painting get their first damage here */
     if (ws->wobblyWindows)
-	damageScreen (s);
+    {
+	CompWindow *w;
+
+	for (w = s->windows; w; w = w->next)
+	{
+	    if (w->pluginsInitialized && GET_WOBBLY_WINDOW (w, ws)->wobbly)
+		wobblyDamageWindow (w);
+	}
+    }
 
     UNWRAP (ws, s, donePaintScreen);
     (*s->donePaintScreen) (s);
@@ -903,20 +1364,22 @@ wobblyTransformWindow (CompWindow              *w,
 			      w->width, w->height);
 
 	    ww->wobbly = ws->wobblyWindows = TRUE;
+	    w->deformed = TRUE;
 	}
 
 	if (ww->model->translate.x != attrib->xTranslate ||
 	    ww->model->translate.y != attrib->yTranslate)
 	{
-	    ww->model->anchorObject->position.x +=
+	    ww->model->px[ww->model->anchorObject] +=
 		attrib->xTranslate - ww->model->translate.x;
-	    ww->model->anchorObject->position.y +=
+	    ww->model->py[ww->model->anchorObject] +=
 		attrib->yTranslate - ww->model->translate.y;
 
 	    ww->model->translate.x = attrib->xTranslate;
 	    ww->model->translate.y = attrib->yTranslate;
 
 	    ww->wobbly = ws->wobblyWindows = TRUE;
+	    w->deformed = TRUE;
 	}
 
 	if (ww->model->translate.x != 0.0f ||
@@ -929,6 +1392,139 @@ wobblyTransformWindow (CompWindow              *w,
     }
 }
 
+/* each row of the grid is a triangle strip, rows and clip rectangles
+   are joined with degenerate triangles so the whole window is drawn
+   as a single strip */
+static Bool
+wobblyAddGridIndices (CompWindow *w,
+		      int	 width,
+		      int	 height,
+		      int	 base,
+		      int	 *nIndices)
+{
+    WobblyIndexList *list, *l;
+    WobblyGridShape *shape;
+    GLuint	    *i;
+    int		    x, y, j, n = *nIndices;
+
+    WOBBLY_WINDOW (w);
+
+    list = &ww->lists[ww->list];
+
+    /* lists that start with the same shapes hold the same indices for
+       them, so the pass can continue in any list that has this grid next */
+    for (j = 0; j < WOBBLY_INDEX_LISTS; j++)
+    {
+	l = &ww->lists[(ww->list + j) % WOBBLY_INDEX_LISTS];
+
+	if (l->nShapes <= ww->shape)
+	    continue;
+
+	shape = &l->shapes[ww->shape];
+	if (shape->width != width || shape->height != height)
+	    continue;
+
+	if (l != list && memcmp (l->shapes, list->shapes,
+				 sizeof (WobblyGridShape) * ww->shape))
+	    continue;
+
+	ww->list = l - ww->lists;
+	l->used  = ww->passes;
+
+	*nIndices = shape->nIndices;
+	ww->shape++;
+
+	return TRUE;
+    }
+
+    /* a list that ends with this pass so far is extended, otherwise
+       the least recently used list is rewritten and the shapes of this
+       pass so far are kept in the list they came from */
+    if (ww->shape && list->nShapes == ww->shape)
+    {
+	l = list;
+    }
+    else
+    {
+	l = 0;
+	for (j = 0; j < WOBBLY_INDEX_LISTS; j++)
+	{
+	    if (ww->shape && j == ww->list)
+		continue;
+
+	    if (!l || ww->lists[j].used < l->used)
+		l = &ww->lists[j];
+	}
+    }
+
+    if (ww->shape >= l->shapeSize)
+    {
+	shape = realloc (l->shapes,
+			 sizeof (WobblyGridShape) * (ww->shape + 16));
+	if (!shape)
+	    return FALSE;
+
+	l->shapes    = shape;
+	l->shapeSize = ww->shape + 16;
+    }
+
+    if (n + (height - 1) * (width + 1) * 2 > l->indexSize)
+    {
+	i = realloc (l->indices,
+		     sizeof (GLuint) * (n + (height - 1) * (width + 1) * 2));
+	if (!i)
+	    return FALSE;
+
+	l->indices   = i;
+	l->indexSize = n + (height - 1) * (width + 1) * 2;
+    }
+
+    if (l != list && ww->shape)
+    {
+	memcpy (l->shapes, list->shapes,
+		sizeof (WobblyGridShape) * ww->shape);
+	memcpy (l->indices, list->indices, sizeof (GLuint) * n);
+    }
+
+    i = l->indices + n;
+
+    for (y = 0; y < height - 1; y++)
+    {
+	if (n)
+	{
+	    i[0] = i[-1];
+	    i[1] = base + width * (y + 1);
+
+	    i += 2;
+	    n += 2;
+	}
+
+	for (x = 0; x < width; x++)
+	{
+	    *i++ = base + width * (y + 1) + x;
+	    *i++ = base + width * y + x;
+	}
+
+	n += width * 2;
+    }
+
+    /* later grids follow these indices and have to be rewritten */
+    shape = &l->shapes[ww->shape++];
+    shape->width     = width;
+    shape->height    = height;
+    shape->nVertices = base + width * height;
+    shape->nIndices  = n;
+
+    l->nShapes = ww->shape;
+    l->used    = ww->passes;
+
+    ww->list = l - ww->lists;
+
+    *nIndices = n;
+
+    return TRUE;
+}
+
 static void
 wobblyAddWindowGeometry (CompWindow *w,
 			 CompMatrix *matrix,
@@ -943,14 +1539,20 @@ wobblyAddWindowGeometry (CompWindow *w,
     {
 	BoxPtr   pClip;
 	int      nClip, nVertices, nIndices;
-	GLushort *i;
 	GLfloat  *v;
 	int      x1, y1, x2, y2;
 	float    width, height;
 	float    deformedX, deformedY;
+	float    minX, minY, maxX, maxY;
 	int      x, y, iw, ih;
-	int      vSize, it;
+	int      vSize, it, c, r;
 	int      gridW, gridH;
+	Model    *model = ww->model;
+	int      gw = model->gridWidth;
+	int      gh = model->gridHeight;
+	float    coeffsV[WOBBLY_MODEL_SIZE_MAX];
+	float    rowX[WOBBLY_MODEL_SIZE_MAX], rowY[WOBBLY_MODEL_SIZE_MAX];
+	float    *basis;
 
 	width  = w->width;
 	height = w->height;
@@ -970,11 +1572,24 @@ wobblyAddWindowGeometry (CompWindow *w,
 
 	vSize = 2 + nMatrix * 2;
 
-	nVertices = w->vCount;
-	nIndices  = w->vCount;
+	/* vCount is the number of indices, the vertices of earlier
+	   geometry end where the last grid ends */
+	if (w->vCount && ww->shape)
+	{
+	    nVertices = ww->lists[ww->list].shapes[ww->shape - 1].nVertices;
+	}
+	else
+	{
+	    nVertices = 0;
+	    ww->shape = 0;
+	    ww->passes++;
+	}
+	nIndices = w->vCount;
 
 	v = w->vertices + (nVertices * vSize);
-	i = w->indices  + nIndices;
+
+	minX = minY = MAXSHORT;
+	maxX = maxY = MINSHORT;
 
 	while (nClip--)
 	{
@@ -983,32 +1598,11 @@ wobblyAddWindowGeometry (CompWindow *w,
 	    x2 = pClip->x2;
 	    y2 = pClip->y2;
 
-	    iw = ((x2 - x1 - 1) / gridW) + 1;
-	    ih = ((y2 - y1 - 1) / gridH) + 1;
+	    iw = ((x2 - x1 - 1) / gridW) + 2;
+	    ih = ((y2 - y1 - 1) / gridH) + 2;
 
-	    if (nIndices + (iw * ih * 4) > w->indexSize)
-	    {
-		if (!moreWindowIndices (w, nIndices + (iw * ih * 4)))
-		    return;
-
-		i = w->indices + nIndices;
-	    }
-
-	    iw++;
-	    ih++;
-
-	    for (y = 0; y < ih - 1; y++)
-	    {
-		for (x = 0; x < iw - 1; x++)
-		{
-		    *i++ = nVertices + iw * (y + 1) + x;
-		    *i++ = nVertices + iw * (y + 1) + x + 1;
-		    *i++ = nVertices + iw * y + x + 1;
-		    *i++ = nVertices + iw * y + x;
-
-		    nIndices += 4;
-		}
-	    }
+	    if (!wobblyAddGridIndices (w, iw, ih, nVertices, &nIndices))
+		return;
 
 	    if (((nVertices + iw * ih) * vSize) > w->vertexSize)
 	    {
@@ -1018,21 +1612,62 @@ wobblyAddWindowGeometry (CompWindow *w,
 		v = w->vertices + (nVertices * vSize);
 	    }
 
+	    ww->u1 = MIN (ww->u1, (x1 - w->attrib.x) / width);
+	    ww->v1 = MIN (ww->v1, (y1 - w->attrib.y) / height);
+	    ww->u2 = MAX (ww->u2, (x2 - w->attrib.x) / width);
+	    ww->v2 = MAX (ww->v2, (y2 - w->attrib.y) / height);
+
+	    /* the bezier surface is evaluated in two passes. the basis of
+	       each column is computed once per clip rectangle, each row
+	       then reduces the control grid to a single curve that is
+	       evaluated with the column basis. */
+	    if (!wobblyEnsureBasis (ws, iw * gw))
+		return;
+
+	    for (x = 0; x < iw; x++)
+		bernsteinCoefficients ((MIN (x1 + x * gridW, x2) -
+					w->attrib.x) / width,
+				       gw, ws->basis + x * gw);
+
 	    for (y = y1;; y += gridH)
 	    {
 		if (y > y2)
 		    y = y2;
 
+		bernsteinCoefficients ((y - w->attrib.y) / height, gh, coeffsV);
+
+		for (c = 0; c < gw; c++)
+		{
+		    rowX[c] = rowY[c] = 0.0f;
+
+		    for (r = 0; r < gh; r++)
+		    {
+			rowX[c] += coeffsV[r] * model->px[r * gw + c];
+			rowY[c] += coeffsV[r] * model->py[r * gw + c];
+		    }
+		}
+
+		basis = ws->basis;
+
 		for (x = x1;; x += gridW)
 		{
 		    if (x > x2)
 			x = x2;
 
-		    bezierPatchEvaluate (ww->model,
-					 (x - w->attrib.x) / width,
-					 (y - w->attrib.y) / height,
-					 &deformedX,
-					 &deformedY);
+		    deformedX = deformedY = 0.0f;
+
+		    for (c = 0; c < gw; c++)
+		    {
+			deformedX += basis[c] * rowX[c];
+			deformedY += basis[c] * rowY[c];
+		    }
+
+		    basis += gw;
+
+		    minX = MIN (minX, deformedX);
+		    minY = MIN (minY, deformedY);
+		    maxX = MAX (maxX, deformedX);
+		    maxY = MAX (maxY, deformedY);
 
 		    for (it = 0; it < nMatrix; it++)
 		    {
@@ -1057,6 +1692,25 @@ wobblyAddWindowGeometry (CompWindow *w,
 	}
 
 	w->vCount = nIndices;
+
+	/* one pixel of padding for filtering, like the model bounds */
+	if (minX <= maxX)
+	{
+	    if (ww->painted.x1 < ww->painted.x2)
+	    {
+		ww->painted.x1 = MIN (ww->painted.x1, floor (minX) - 1);
+		ww->painted.y1 = MIN (ww->painted.y1, floor (minY) - 1);
+		ww->painted.x2 = MAX (ww->painted.x2, ceil (maxX) + 1);
+		ww->painted.y2 = MAX (ww->painted.y2, ceil (maxY) + 1);
+	    }
+	    else
+	    {
+		ww->painted.x1 = floor (minX) - 1;
+		ww->painted.y1 = floor (minY) - 1;
+		ww->painted.x2 = ceil (maxX) + 1;
+		ww->painted.y2 = ceil (maxY) + 1;
+	    }
+	}
     }
     else
     {
@@ -1093,7 +1747,8 @@ wobblyDrawWindowGeometry (CompWindow *w)
 	    glTexCoordPointer (2, GL_FLOAT, stride, vertices);
 	}
 
-	glDrawElements (GL_QUADS, w->vCount, GL_UNSIGNED_SHORT, w->indices);
+	glDrawElements (GL_TRIANGLE_STRIP, w->vCount, GL_UNSIGNED_INT,
+			ww->lists[ww->list].indices);
     }
     else
     {
@@ -1164,7 +1819,7 @@ wobblyHandleEvent (CompDisplay *d,
     switch (event->type) {
     case ConfigureNotify:
 	w = findWindowAtDisplay (d, event->xmap.window);
-	if (w && isWobblyWin (w))
+	if (w && w->pluginsInitialized && isWobblyWin (w))
 	{
 	    if (w->attrib.width        != event->xconfigure.width  ||
 		w->attrib.height       != event->xconfigure.height ||
@@ -1193,7 +1848,8 @@ wobblyHandleEvent (CompDisplay *d,
 				      width, height);
 
 		    ww->wobbly = ws->wobblyWindows = TRUE;
-		    damageScreen (w->screen);
+		    w->deformed = TRUE;
+		    wobblyDamageWindow (w);
 		}
 		else if (ww->model)
 		{
@@ -1257,7 +1913,7 @@ wobblyHandleEvent (CompDisplay *d,
 		CompWindow *w;
 
 		w = findClientWindowAtScreen (s, s->activeWindow);
-		if (w && isWobblyWin (w))
+		if (w && w->pluginsInitialized && isWobblyWin (w))
 		{
 		    WOBBLY_WINDOW (w);
 		    WOBBLY_SCREEN (w->screen);
@@ -1283,7 +1939,8 @@ wobblyHandleEvent (CompDisplay *d,
 			}
 
 			ww->wobbly = ws->wobblyWindows = TRUE;
-			damageScreen (w->screen);
+			w->deformed = TRUE;
+			wobblyDamageWindow (w);
 		    }
 		}
 	    }
@@ -1326,7 +1983,8 @@ wobblyDamageWindowRect (CompWindow *w,
 		}
 
 		ww->wobbly = ws->wobblyWindows = TRUE;
-		damageScreen (w->screen);
+		w->deformed = TRUE;
+		wobblyDamageWindow (w);
 	    }
 	}
     }
@@ -1351,8 +2009,28 @@ wobblyPaintScreen (CompScreen		   *s,
 
     if (ws->wobblyWindows)
     {
-	mask &= ~PAINT_SCREEN_REGION_MASK;
 	mask |= PAINT_SCREEN_WITH_TRANSFORMED_WINDOWS_MASK;
+
+	/* only the damaged region is copied to the front buffer so the
+	   transformed screen is painted with a scissor around it */
+	if ((mask & PAINT_SCREEN_REGION_MASK) &&
+	    !(mask & PAINT_SCREEN_FULL_MASK))
+	{
+	    glEnable (GL_SCISSOR_TEST);
+	    glScissor (region->extents.x1,
+		       s->height - region->extents.y2,
+		       region->extents.x2 - region->extents.x1,
+		       region->extents.y2 - region->extents.y1);
+
+	    UNWRAP (ws, s, paintScreen);
+	    status = (*s->paintScreen) (s, sAttrib, wAttrib, region,
+					mask | PAINT_SCREEN_FULL_MASK);
+	    WRAP (ws, s, paintScreen, wobblyPaintScreen);
+
+	    glDisable (GL_SCISSOR_TEST);
+
+	    return status;
+	}
     }
 
     UNWRAP (ws, s, paintScreen);
@@ -1427,7 +2105,8 @@ wobblyInitScreen (CompPlugin *p,
     if (!ws)
 	return FALSE;
 
-    ws->windowPrivateIndex = allocateWindowPrivateIndex (s);
+    ws->windowPrivateIndex =
+	allocateSizedWindowPrivateIndex (s, sizeof (WobblyWindow));
     if (ws->windowPrivateIndex < 0)
     {
 	free (ws);
@@ -1436,6 +2115,10 @@ wobblyInitScreen (CompPlugin *p,
 
     ws->wobblyWindows = FALSE;
 
+
+    ws->basis	  = 0;
+    ws->basisSize = 0;
+
     ws->mapEffect   = WobblyEffectShiver;
     ws->focusEffect = WobblyEffectNone;
 
@@ -1463,6 +2146,10 @@ wobblyFiniScreen (CompPlugin *p,
 
     freeWindowPrivateIndex (s, ws->windowPrivateIndex);
 
+
+    if (ws->basis)
+	free (ws->basis);
+
     free (ws->opt[WOBBLY_SCREEN_OPTION_MAP_EFFECT].value.s);
     free (ws->opt[WOBBLY_SCREEN_OPTION_FOCUS_EFFECT].value.s);
 
@@ -1486,14 +2173,18 @@ wobblyInitWindow (CompPlugin *p,
 
     WOBBLY_SCREEN (w->screen);
 
-    ww = malloc (sizeof (WobblyWindow));
-    if (!ww)
-	return FALSE;
+    ww = GET_WOBBLY_WINDOW (w, ws);
 
     ww->model  = 0;
     ww->wobbly = FALSE;
 
-    w->privates[ws->windowPrivateIndex].ptr = ww;
+    wobblyResetBounds (ww);
+
+    memset (ww->lists, 0, sizeof (ww->lists));
+
+    ww->list   = 0;
+    ww->shape  = 0;
+    ww->passes = 0;
 
     return TRUE;
 }
@@ -1502,15 +2193,23 @@ static void
 wobblyFiniWindow (CompPlugin *p,
 		  CompWindow *w)
 {
+    int i;
+
     WOBBLY_WINDOW (w);
 
     if (ww->model)
+	destroyModel (ww->model);
+
+    for (i = 0; i < WOBBLY_INDEX_LISTS; i++)
     {
-	free (ww->model->objects);
-	free (ww->model);
+	if (ww->lists[i].shapes)
+	    free (ww->lists[i].shapes);
+
+	if (ww->lists[i].indices)
+	    free (ww->lists[i].indices);
     }
 
-    free (ww);
+    w->deformed = FALSE;
 }
 
 static Bool
@@ -0,0 +1,501 @@
+/*
+ * Copyright © 2005 Novell, Inc.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of
+ * Novell, Inc. not be used in advertising or publicity pertaining to
+ * distribution of the software without specific, written prior permission.
+ * Novell, Inc. makes no representations about the suitability of this
+ * software for any purpose. It is provided "as is" without express or
+ * implied warranty.
+ *
+ * NOVELL, INC. DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL NOVELL, INC. BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Author: David Reveman <davidr@novell.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <comp.h>
+
+/* The painted rectangles of each frame are read back into a pixel
+   buffer object and the buffer is mapped two frames later, by then the
+   copy has completed and mapping doesn't stall the pipeline. Without
+   pixel buffer objects the frame is read synchronously. */
+
+#define CAPTURE_RING_SIZE 3
+
+typedef struct _CompCaptureFrame {
+    GLuint buffer;
+    int    bufferSize;
+    char   *data;
+    Bool   pending;
+    BoxPtr rects;
+    int    nRects;
+    int    sizeRects;
+} CompCaptureFrame;
+
+struct _CompCapture {
+    CompCapture	     *next;
+    CaptureFrameProc proc;
+    void	     *closure;
+    CompCaptureFrame frame[CAPTURE_RING_SIZE];
+    int		     current;
+};
+
+CompCapture *
+addScreenCapture (CompScreen	   *screen,
+		  CaptureFrameProc proc,
+		  void		   *closure)
+{
+    CompCapture *capture;
+
+    capture = calloc (1, sizeof (CompCapture));
+    if (!capture)
+	return NULL;
+
+    capture->proc    = proc;
+    capture->closure = closure;
+
+    capture->next = screen->captures;
+    screen->captures = capture;
+
+    return capture;
+}
+
+/* frames still in flight are dropped */
+void
+removeScreenCapture (CompScreen  *screen,
+		     CompCapture *capture)
+{
+    CompCapture **c;
+    int		i;
+
+    for (c = &screen->captures; *c; c = &(*c)->next)
+    {
+	if (*c == capture)
+	{
+	    *c = capture->next;
+	    break;
+	}
+    }
+
+    for (i = 0; i < CAPTURE_RING_SIZE; i++)
+    {
+	if (capture->frame[i].buffer)
+	    (*screen->deleteBuffers) (1, &capture->frame[i].buffer);
+
+	if (capture->frame[i].data)
+	    free (capture->frame[i].data);
+
+	if (capture->frame[i].rects)
+	    free (capture->frame[i].rects);
+    }
+
+    free (capture);
+}
+
+static void
+deliverFrame (CompScreen       *screen,
+	      CompCapture      *capture,
+	      CompCaptureFrame *frame,
+	      const char       *data)
+{
+    (*capture->proc) (screen, data, frame->rects, frame->nRects,
+		      capture->closure);
+}
+
+static void
+finishFrame (CompScreen	      *screen,
+	     CompCapture      *capture,
+	     CompCaptureFrame *frame)
+{
+    char *data;
+
+    (*screen->bindBuffer) (GL_PIXEL_PACK_BUFFER_ARB, frame->buffer);
+
+    data = (*screen->mapBuffer) (GL_PIXEL_PACK_BUFFER_ARB, GL_READ_ONLY_ARB);
+    if (data)
+    {
+	deliverFrame (screen, capture, frame, data);
+
+	(*screen->unmapBuffer) (GL_PIXEL_PACK_BUFFER_ARB);
+    }
+
+    (*screen->bindBuffer) (GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+    frame->pending = FALSE;
+}
+
+/* each rectangle is read on its own, reading the extents of distant
+   rectangles would read back most of the screen */
+static Bool
+readFrame (CompScreen	    *screen,
+	   CompCaptureFrame *frame,
+	   Region	    region)
+{
+    BoxPtr pBox;
+    char   *data;
+    int	   i, width, height, size = 0;
+
+    if (region->numRects > frame->sizeRects)
+    {
+	BoxPtr rects;
+
+	rects = realloc (frame->rects, sizeof (BoxRec) * region->numRects);
+	if (!rects)
+	    return FALSE;
+
+	frame->rects     = rects;
+	frame->sizeRects = region->numRects;
+    }
+
+    memcpy (frame->rects, region->rects, sizeof (BoxRec) * region->numRects);
+    frame->nRects = region->numRects;
+
+    for (i = 0; i < frame->nRects; i++)
+	size += (frame->rects[i].x2 - frame->rects[i].x1) *
+	    (frame->rects[i].y2 - frame->rects[i].y1) * 4;
+
+    if (screen->pbo)
+    {
+	if (!frame->buffer)
+	    (*screen->genBuffers) (1, &frame->buffer);
+
+	(*screen->bindBuffer) (GL_PIXEL_PACK_BUFFER_ARB, frame->buffer);
+
+	if (size > frame->bufferSize)
+	{
+	    (*screen->bufferData) (GL_PIXEL_PACK_BUFFER_ARB, size, NULL,
+				   GL_STREAM_READ_ARB);
+	    frame->bufferSize = size;
+	}
+
+	/* offsets into the bound buffer */
+	data = NULL;
+    }
+    else
+    {
+	if (size > frame->bufferSize)
+	{
+	    data = realloc (frame->data, size);
+	    if (!data)
+		return FALSE;
+
+	    frame->data	      = data;
+	    frame->bufferSize = size;
+	}
+
+	data = frame->data;
+    }
+
+    for (i = 0; i < frame->nRects; i++)
+    {
+	pBox = &frame->rects[i];
+
+	width  = pBox->x2 - pBox->x1;
+	height = pBox->y2 - pBox->y1;
+
+	glReadPixels (pBox->x1, screen->height - pBox->y2, width, height,
+		      GL_BGRA,
+
+#if IMAGE_BYTE_ORDER == MSBFirst
+		      GL_UNSIGNED_INT_8_8_8_8_REV,
+#else
+		      GL_UNSIGNED_BYTE,
+#endif
+
+		      data);
+
+	data += width * height * 4;
+    }
+
+    if (screen->pbo)
+	(*screen->bindBuffer) (GL_PIXEL_PACK_BUFFER_ARB, 0);
+
+    return TRUE;
+}
+
+/* called with the painted region after each paintScreen and before
+   the back buffer is swapped or copied to the front buffer */
+void
+captureScreen (CompScreen *screen,
+	       Region	  region)
+{
+    CompCapture	     *capture;
+    CompCaptureFrame *frame;
+
+    if (!REGION_NOT_EMPTY (region))
+	return;
+
+    for (capture = screen->captures; capture; capture = capture->next)
+    {
+	frame = &capture->frame[capture->current];
+
+	if (!readFrame (screen, frame, region))
+	    continue;
+
+	if (!screen->pbo)
+	{
+	    deliverFrame (screen, capture, frame, frame->data);
+	    continue;
+	}
+
+	frame->pending = TRUE;
+
+	capture->current = (capture->current + 1) % CAPTURE_RING_SIZE;
+
+	/* next frame in the ring was read two frames ago */
+	frame = &capture->frame[capture->current];
+	if (frame->pending)
+	    finishFrame (screen, capture, frame);
+    }
+}
+
+void
+flushScreenCaptures (CompScreen *screen)
+{
+    CompCapture	     *capture;
+    CompCaptureFrame *frame;
+    int		     i;
+
+    for (capture = screen->captures; capture; capture = capture->next)
+    {
+	for (i = 1; i <= CAPTURE_RING_SIZE; i++)
+	{
+	    frame = &capture->frame[(capture->current + i) % CAPTURE_RING_SIZE];
+	    if (frame->pending)
+		finishFrame (screen, capture, frame);
+	}
+    }
+}
+
+/* sink for the capture_file option. each frame's rectangles are
+   copied and handed to the worker thread, which keeps a copy of the
+   whole screen up to date and appends it to the file as a binary PPM
+   image, most video encoders read a stream of these. the screen copy
+   is only touched by work procs, they run one at a time. */
+
+/* frames queued for the worker before frames are dropped */
+#define FILE_SINK_MAX_JOBS 4
+
+typedef struct _CompFileSinkJob {
+    struct _CompFileSinkJob *next;
+    CompFileSink	    *sink;
+    CompWorkHandle	    handle;
+    char		    *data;
+    BoxPtr		    rects;
+    int			    nRects;
+    int			    width;
+    int			    height;
+} CompFileSinkJob;
+
+struct _CompFileSink {
+    CompCapture	    *capture;
+    FILE	    *file;
+    unsigned char   *frame;
+    int		    width;
+    int		    height;
+    CompFileSinkJob *jobs;
+    int		    nJobs;
+};
+
+static void
+freeFileSinkJob (CompFileSinkJob *job)
+{
+    CompFileSinkJob **j;
+
+    for (j = &job->sink->jobs; *j; j = &(*j)->next)
+    {
+	if (*j == job)
+	{
+	    *j = job->next;
+	    break;
+	}
+    }
+
+    job->sink->nJobs--;
+
+    free (job->data);
+    free (job->rects);
+    free (job);
+}
+
+static void
+fileSinkWrite (void *closure)
+{
+    CompFileSinkJob *job = closure;
+    CompFileSink    *sink = job->sink;
+    unsigned char   *dst;
+    const char	    *src = job->data;
+    unsigned int    pixel;
+    int		    i, px, py;
+
+    if (sink->width != job->width || sink->height != job->height)
+    {
+	unsigned char *frame;
+
+	frame = calloc (job->width * job->height, 3);
+	if (!frame)
+	    return;
+
+	free (sink->frame);
+
+	sink->frame  = frame;
+	sink->width  = job->width;
+	sink->height = job->height;
+    }
+
+    for (i = 0; i < job->nRects; i++)
+    {
+	for (py = job->rects[i].y2 - 1; py >= job->rects[i].y1; py--)
+	{
+	    dst = sink->frame + (py * sink->width + job->rects[i].x1) * 3;
+
+	    for (px = job->rects[i].x1; px < job->rects[i].x2; px++)
+	    {
+		memcpy (&pixel, src, 4);
+
+		*dst++ = pixel >> 16;
+		*dst++ = pixel >> 8;
+		*dst++ = pixel;
+
+		src += 4;
+	    }
+	}
+    }
+
+    fprintf (sink->file, "P6\n%d %d\n255\n", sink->width, sink->height);
+    fwrite (sink->frame, 3, sink->width * sink->height, sink->file);
+}
+
+static void
+fileSinkWritten (void *closure)
+{
+    freeFileSinkJob (closure);
+}
+
+static void
+fileSinkFrame (CompScreen *screen,
+	       const char *data,
+	       BoxPtr	  rects,
+	       int	  nRects,
+	       void	  *closure)
+{
+    CompFileSink    *sink = closure;
+    CompFileSinkJob *job;
+    int		    i, size = 0;
+
+    /* a frame that can't be queued is dropped, the next frame has to
+       contain the whole screen again */
+    if (sink->nJobs >= FILE_SINK_MAX_JOBS)
+    {
+	damageScreen (screen);
+	return;
+    }
+
+    for (i = 0; i < nRects; i++)
+	size += (rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1) * 4;
+
+    job = calloc (1, sizeof (CompFileSinkJob));
+    if (!job)
+	return;
+
+    job->data  = malloc (size);
+    job->rects = malloc (sizeof (BoxRec) * nRects);
+    if (!job->data || !job->rects)
+    {
+	free (job->data);
+	free (job->rects);
+	free (job);
+	return;
+    }
+
+    memcpy (job->data, data, size);
+    memcpy (job->rects, rects, sizeof (BoxRec) * nRects);
+
+    job->sink	= sink;
+    job->nRects = nRects;
+    job->width	= screen->width;
+    job->height = screen->height;
+
+    job->next  = sink->jobs;
+    sink->jobs = job;
+    sink->nJobs++;
+
+    job->handle = compAddWork (fileSinkWrite, fileSinkWritten, job);
+    if (!job->handle)
+    {
+	freeFileSinkJob (job);
+	damageScreen (screen);
+    }
+}
+
+/* an empty file name stops capturing */
+Bool
+setScreenCaptureFile (CompScreen *screen,
+		      const char *fileName)
+{
+    CompFileSink *sink = screen->fileSink;
+
+    if (sink)
+    {
+	removeScreenCapture (screen, sink->capture);
+
+	/* queued frames are dropped, one that is being written is
+	   finished before the file is closed */
+	while (sink->jobs)
+	{
+	    compRemoveWork (sink->jobs->handle);
+	    freeFileSinkJob (sink->jobs);
+	}
+
+	fclose (sink->file);
+	free (sink->frame);
+	free (sink);
+
+	screen->fileSink = NULL;
+    }
+
+    if (!fileName || !*fileName)
+	return TRUE;
+
+    sink = calloc (1, sizeof (CompFileSink));
+    if (!sink)
+	return FALSE;
+
+    sink->file = fopen (fileName, "ab");
+    if (!sink->file)
+    {
+	fprintf (stderr, "%s: Couldn't open capture file: %s\n",
+		 programName, fileName);
+	free (sink);
+	return FALSE;
+    }
+
+    sink->capture = addScreenCapture (screen, fileSinkFrame, sink);
+    if (!sink->capture)
+    {
+	fclose (sink->file);
+	free (sink);
+	return FALSE;
+    }
+
+    screen->fileSink = sink;
+
+    /* the first frame has to contain the whole screen */
+    damageScreen (screen);
+
+    return TRUE;
+}
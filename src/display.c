@@ -177,6 +177,8 @@ setDisplayOption (CompDisplay     *display,
 	    else
 		display->textureFilter = GL_LINEAR;
 
+	    display->textureMipmap = (strcmp (o->value.s, "Best") == 0);
+
 	    return TRUE;
 	}
     default:
@@ -393,6 +395,38 @@ compRemoveTimeout (CompTimeoutHandle handle)
     ((((tv1)->tv_sec - 1 - (tv2)->tv_sec) * 1000000) +			   \
      (1000000 + (tv1)->tv_usec - (tv2)->tv_usec)) / 1000
 
+static unsigned long
+regionArea (Region region)
+{
+    unsigned long area = 0;
+    BoxPtr	  pBox = region->rects;
+    int		  nBox = region->numRects;
+
+    while (nBox--)
+    {
+	area += (pBox->x2 - pBox->x1) * (pBox->y2 - pBox->y1);
+	pBox++;
+    }
+
+    return area;
+}
+
+/* the painted_pixels option is in thousands of pixels */
+static void
+addPaintedPixels (CompScreen *s,
+		  Region     region)
+{
+    unsigned long long kpixels;
+
+    s->paintedPixels += regionArea (region);
+
+    kpixels = s->paintedPixels / 1000;
+    if (kpixels > 0x7fffffff)
+	kpixels = 0x7fffffff;
+
+    s->opt[COMP_SCREEN_OPTION_PAINTED_PIXELS].value.i = kpixels;
+}
+
 static int
 getTimeToNextRedraw (CompScreen     *s,
 		     struct timeval *lastTv)
@@ -576,7 +610,7 @@ void
 eventLoop (void)
 {
     XEvent	   event;
-    struct pollfd  ufd;
+    struct pollfd  ufd[2];
     int		   timeDiff;
     struct timeval tv;
     Region	   tmpRegion;
@@ -586,6 +620,7 @@ eventLoop (void)
     CompWindow	   *move = 0;
     int		   px = 0, py = 0;
     CompTimeout    *t;
+    Bool	   uploading;
 
     tmpRegion = XCreateRegion ();
     if (!tmpRegion)
@@ -594,8 +629,9 @@ eventLoop (void)
 	return;
     }
 
-    ufd.fd = ConnectionNumber (display->display);
-    ufd.events = POLLIN;
+    ufd[0].fd = ConnectionNumber (display->display);
+    ufd[0].events = POLLIN;
+    ufd[1].events = POLLIN;
 
     for (;;)
     {
@@ -608,6 +644,15 @@ eventLoop (void)
 	     exit (1);
 	}
 
+	/* the worker pipe is created when work is first added */
+	ufd[1].fd = compWorkFd ();
+
+	compProcessFinishedWork ();
+
+	uploading = FALSE;
+	if (s->imageLoads)
+	    uploading = uploadImages (s);
+
 	while (XPending (display->display))
 	{
 	    XNextEvent (display->display, &event);
@@ -729,6 +774,10 @@ eventLoop (void)
 
 		timeDiff = TIMEVALDIFF (&tv, &s->lastRedraw);
 
+		updateMappedWindows (s);
+
+		s->frameCount++;
+
 		(*s->preparePaintScreen) (s, timeDiff);
 
 		if (s->allDamaged)
@@ -743,6 +792,11 @@ eventLoop (void)
 				       PAINT_SCREEN_REGION_MASK |
 				       PAINT_SCREEN_FULL_MASK);
 
+		    addPaintedPixels (s, &s->region);
+
+		    if (s->captures)
+			captureScreen (s, &s->region);
+
 		    glXSwapBuffers (s->display->display, s->root);
 		}
 		else
@@ -760,6 +814,11 @@ eventLoop (void)
 			BoxPtr pBox;
 			int    nBox, y;
 
+			addPaintedPixels (s, tmpRegion);
+
+			if (s->captures)
+			    captureScreen (s, tmpRegion);
+
 			glEnable (GL_SCISSOR_TEST);
 			glDrawBuffer (GL_FRONT);
 
@@ -800,6 +859,11 @@ eventLoop (void)
 					   &s->region,
 					   PAINT_SCREEN_FULL_MASK);
 
+			addPaintedPixels (s, &s->region);
+
+			if (s->captures)
+			    captureScreen (s, &s->region);
+
 			glXSwapBuffers (s->display->display, s->root);
 		    }
 		}
@@ -809,34 +873,52 @@ eventLoop (void)
 		(*s->donePaintScreen) (s);
 
 		/* remove destroyed windows */
-		while (s->pendingDestroys)
+		if (s->pendingDestroys)
 		{
 		    CompWindow *w;
 
-		    for (w = s->windows; w; w = w->next)
+		    EMPTY_REGION (tmpRegion);
+
+		    while ((w = s->pendingDestroys))
 		    {
-			if (w->destroyed)
-			{
-			    addWindowDamage (w);
-			    removeWindow (w);
-			    break;
-			}
+			if (!s->allDamaged		      &&
+			    w->attrib.map_state == IsViewable &&
+			    w->damaged			      &&
+			    !(*s->damageWindowRegion) (w, w->region))
+			    XUnionRegion (tmpRegion, w->region, tmpRegion);
+
+			removeWindow (w);
 		    }
 
-		    s->pendingDestroys--;
+		    if (REGION_NOT_EMPTY (tmpRegion))
+			damageScreenRegion (s, tmpRegion);
 		}
+
+		evictWindowTextures (s);
 	    }
 
 	    timeToNextRedraw = getTimeToNextRedraw (s, &s->lastRedraw);
+	    if (timeToNextRedraw && s->pendingBinds)
+	    {
+		prebindWindows (s);
+
+		timeToNextRedraw = getTimeToNextRedraw (s, &s->lastRedraw);
+	    }
+
 	    if (timeToNextRedraw)
-		timeToNextRedraw = poll (&ufd, 1, timeToNextRedraw);
+		timeToNextRedraw = poll (ufd, 2, timeToNextRedraw);
 	}
 	else
 	{
+	    /* nothing more is painted so hand out the frames that are
+	       still in flight */
+	    if (s->captures)
+		flushScreenCaptures (s);
+
 	    if (timeouts)
 	    {
 		if (timeouts->left > 0)
-		    poll (&ufd, 1, timeouts->left);
+		    poll (ufd, 2, uploading ? 0 : timeouts->left);
 
 		gettimeofday (&tv, 0);
 
@@ -864,7 +946,7 @@ eventLoop (void)
 	    }
 	    else
 	    {
-		poll (&ufd, 1, 1000);
+		poll (ufd, 2, uploading ? 0 : 1000);
 		gettimeofday (&s->lastRedraw, 0);
 	    }
 
@@ -987,6 +1069,7 @@ addDisplay (char *name,
     compDisplayInitOptions (d, plugin, nPlugin);
 
     d->textureFilter = GL_LINEAR;
+    d->textureMipmap = FALSE;
 
     d->display = dpy = XOpenDisplay (name);
     if (!d->display)
@@ -1024,6 +1107,8 @@ addDisplay (char *name,
     d->winOpacityAtom = XInternAtom (dpy, "_NET_WM_WINDOW_OPACITY", 0);
     d->winActiveAtom  = XInternAtom (dpy, "_NET_ACTIVE_WINDOW", 0);
 
+    d->winOpaqueRegionAtom = XInternAtom (dpy, "_NET_WM_OPAQUE_REGION", 0);
+
     d->wmStateAtom	  = XInternAtom (dpy, "WM_STATE", 0);
     d->wmDeleteWindowAtom = XInternAtom (dpy, "WM_DELETE_WINDOW", 0);
 
@@ -1071,6 +1156,8 @@ addDisplay (char *name,
 					      &d->shapeEvent,
 					      &d->shapeError);
 
+    d->shmExtension = XShmQueryExtension (dpy);
+
     compDisplays = d;
 
     if (testMode)
@@ -1153,3 +1240,20 @@ findWindowAtDisplay (CompDisplay *d,
 
     return 0;
 }
+
+CompWindow *
+findClientWindowAtDisplay (CompDisplay *d,
+			   Window      id)
+{
+    CompScreen *s;
+    CompWindow *w;
+
+    for (s = d->screens; s; s = s->next)
+    {
+	w = findClientWindowAtScreen (s, id);
+	if (w)
+	    return w;
+    }
+
+    return 0;
+}
@@ -197,14 +197,25 @@ handleEvent (CompDisplay *display,
 		}
 	    }
 	}
+	else if (event->xproperty.atom == display->winOpaqueRegionAtom)
+	{
+	    w = findClientWindowAtDisplay (display, event->xproperty.window);
+	    if (w && w->alpha)
+	    {
+		updateWindowOpaqueRegion (w);
+
+		if (w->attrib.map_state == IsViewable)
+		    addWindowDamage (w);
+	    }
+	}
 	else if (event->xproperty.atom == display->xBackgroundAtom[0] ||
 		 event->xproperty.atom == display->xBackgroundAtom[1])
 	{
 	    s = findScreenAtDisplay (display, event->xproperty.window);
 	    if (s)
 	    {
-		finiTexture (s, &s->backgroundTexture);
-		initTexture (s, &s->backgroundTexture);
+		if (!s->desktopWindowCount)
+		    updateScreenBackground (s, &s->backgroundTexture);
 
 		damageScreen (s);
 	    }
@@ -252,6 +263,10 @@ handleEvent (CompDisplay *display,
 		{
 		    w->damaged = initial = TRUE;
 		    w->invisible = WINDOW_INVISIBLE (w);
+
+		    /* bind the new window's pixmap if there's time left
+		       before it's painted */
+		    w->screen->pendingBinds = TRUE;
 		}
 
 		region.extents.x1 = de->geometry.x + de->area.x;
@@ -259,6 +274,27 @@ handleEvent (CompDisplay *display,
 		region.extents.x2 = region.extents.x1 + de->area.width;
 		region.extents.y2 = region.extents.y1 + de->area.height;
 
+		w->texture.mipmapDamaged = TRUE;
+
+		if (w->resized)
+		    w->resizeDamaged = TRUE;
+
+		/* contents are copied to the texture before painting */
+		if (w->texture.damage)
+		{
+		    REGION rect;
+
+		    rect.rects = &rect.extents;
+		    rect.numRects = rect.size = 1;
+
+		    rect.extents.x1 = region.extents.x1 - w->attrib.x;
+		    rect.extents.y1 = region.extents.y1 - w->attrib.y;
+		    rect.extents.x2 = region.extents.x2 - w->attrib.x;
+		    rect.extents.y2 = region.extents.y2 - w->attrib.y;
+
+		    XUnionRegion (&rect, w->texture.damage, w->texture.damage);
+		}
+
 		if (!(*w->screen->damageWindowRect) (w, initial, 
 						     &region.extents))
 		{
@@ -44,6 +44,17 @@ preparePaintScreen (CompScreen *screen,
 void
 donePaintScreen (CompScreen *screen) {}
 
+/* maps X coordinates of the screen to the untransformed screen */
+void
+prepareXCoords (CompScreen *screen)
+{
+    glTranslatef (0.0f, 0.0f, -BASE_Z_TRANSLATE);
+
+    glTranslatef (-0.5f, -0.5f, 0.5f);
+    glScalef (1.0f / screen->width, -1.0f / screen->height, 1.0f);
+    glTranslatef (0.0f, -screen->height, 0.0f);
+}
+
 void
 paintTransformedScreen (CompScreen		*screen,
 			const ScreenPaintAttrib *sAttrib,
@@ -53,6 +64,7 @@ paintTransformedScreen (CompScreen		*screen,
     CompWindow *w;
     int	       windowMask;
     int	       backgroundMask;
+    int	       i;
 
     glPushMatrix ();
 
@@ -85,8 +97,10 @@ paintTransformedScreen (CompScreen		*screen,
 
 	    glEnable (GL_STENCIL_TEST);
 
-	    for (w = screen->windows; w; w = w->next)
+	    for (i = 0; i < screen->nMapped; i++)
 	    {
+		w = screen->mapped[i];
+
 		if (w->destroyed || w->attrib.map_state != IsViewable)
 		    continue;
 
@@ -107,8 +121,10 @@ paintTransformedScreen (CompScreen		*screen,
 
     (*screen->paintBackground) (screen, &screen->region, backgroundMask);
 
-    for (w = screen->windows; w; w = w->next)
+    for (i = 0; i < screen->nMapped; i++)
     {
+	w = screen->mapped[i];
+
 	if (w->destroyed || w->attrib.map_state != IsViewable)
 	    continue;
 
@@ -128,6 +144,7 @@ paintScreen (CompScreen		     *screen,
 {
     static Region tmpRegion = NULL;
     CompWindow	  *w;
+    int		  i;
 
     if (mask & PAINT_SCREEN_REGION_MASK)
     {
@@ -167,21 +184,20 @@ paintScreen (CompScreen		     *screen,
 
     glPushMatrix ();
 
-    glTranslatef (0.0f, 0.0f, -BASE_Z_TRANSLATE);
-
-    glTranslatef (-0.5f, -0.5f, 0.5f);
-    glScalef (1.0f / screen->width, -1.0f / screen->height, 1.0f);
-    glTranslatef (0.0f, -screen->height, 0.0f);
+    prepareXCoords (screen);
 
     /* paint solid windows */
-    for (w = screen->reverseWindows; w; w = w->prev)
+    for (i = screen->nMapped - 1; i >= 0; i--)
     {
+	w = screen->mapped[i];
+
 	if (w->destroyed || w->invisible)
 	    continue;
 
 	if ((*screen->paintWindow) (w, wAttrib, tmpRegion,
 				    PAINT_WINDOW_SOLID_MASK))
-	    XSubtractRegion (tmpRegion, w->region, tmpRegion);
+	    XSubtractRegion (tmpRegion, w->alpha ? w->opaque : w->region,
+			     tmpRegion);
 
 	/* copy region */
 	XSubtractRegion (tmpRegion, &emptyRegion, w->clip);
@@ -194,8 +210,10 @@ paintScreen (CompScreen		     *screen,
 	(*screen->paintBackground) (screen, tmpRegion, 0);
 
     /* paint translucent windows */
-    for (w = screen->windows; w; w = w->next)
+    for (i = 0; i < screen->nMapped; i++)
     {
+	w = screen->mapped[i];
+
 	if (w->destroyed || w->invisible)
 	    continue;
 
@@ -258,25 +276,6 @@ moreWindowVertices (CompWindow *w,
     return TRUE;
 }
 
-Bool
-moreWindowIndices (CompWindow *w,
-		   int        newSize)
-{
-    if (newSize > w->indexSize)
-    {
-	GLushort *indices;
-
-	indices = realloc (w->indices, sizeof (GLushort) * newSize);
-	if (!indices)
-	    return FALSE;
-
-	w->indices = indices;
-	w->indexSize = newSize;
-    }
-
-    return TRUE;
-}
-
 void
 addWindowGeometry (CompWindow *w,
 		   CompMatrix *matrix,
@@ -426,11 +425,12 @@ paintWindow (CompWindow		     *w,
 	     Region		     region,
 	     unsigned int	     mask)
 {
-    GLushort opacity;
+    GLushort	      opacity;
+    CompTextureFilter filter;
 
     if (mask & PAINT_WINDOW_SOLID_MASK)
     {
-	if (w->alpha)
+	if (w->alpha && !REGION_NOT_EMPTY (w->opaque))
 	    return FALSE;
 
 	opacity = MULTIPLY_USHORT (w->opacity, attrib->opacity);
@@ -452,14 +452,24 @@ paintWindow (CompWindow		     *w,
 	    mask |= PAINT_WINDOW_SOLID_MASK;
     }
 
-    if (!w->pixmap)
+    if (!w->pixmap || w->resizeDamaged)
 	bindWindow (w);
+    else if (w->texture.damage)
+	updatePixmapTexture (w->screen, &w->texture);
+
+    w->lastPaint = w->screen->frameCount;
 
     if (mask & PAINT_WINDOW_TRANSFORMED_MASK)
 	region = &infiniteRegion;
 
     w->vCount = 0;
-    (*w->screen->addWindowGeometry) (w, &w->matrix, 1, w->region, region);
+
+    /* only the opaque part of windows with an alpha channel is drawn
+       in the solid pass, the rest is blended in the translucent pass */
+    if (w->alpha && (mask & PAINT_WINDOW_SOLID_MASK))
+	(*w->screen->addWindowGeometry) (w, &w->matrix, 1, w->opaque, region);
+    else
+	(*w->screen->addWindowGeometry) (w, &w->matrix, 1, w->region, region);
     if (w->vCount)
     {
 	if (mask & PAINT_WINDOW_TRANSLUCENT_MASK)
@@ -481,17 +491,29 @@ paintWindow (CompWindow		     *w,
 	    glScalef (attrib->xScale, attrib->yScale, 0.0f);
 	    glTranslatef (-w->attrib.x, -w->attrib.y, 0.0f);
 
-	    enableTexture (w->screen, &w->texture, COMP_TEXTURE_FILTER_GOOD);
+	    if (attrib->xScale < 1.0f || attrib->yScale < 1.0f)
+		filter = COMP_TEXTURE_FILTER_BEST;
+	    else
+		filter = COMP_TEXTURE_FILTER_GOOD;
 	}
 	else if (mask & PAINT_WINDOW_ON_TRANSFORMED_SCREEN_MASK)
 	{
-	    enableTexture (w->screen, &w->texture, COMP_TEXTURE_FILTER_GOOD);
+	    filter = COMP_TEXTURE_FILTER_GOOD;
 	}
 	else
 	{
-	    enableTexture (w->screen, &w->texture, COMP_TEXTURE_FILTER_FAST);
+	    filter = COMP_TEXTURE_FILTER_FAST;
 	}
 
+	/* mipmaps are dropped as soon as the window is drawn unscaled */
+	if (filter != COMP_TEXTURE_FILTER_BEST && w->texture.mipmap)
+	    releaseTextureMipmap (w->screen, &w->texture);
+
+	enableTexture (w->screen, &w->texture, filter);
+
+	/* a mipmap may have been created or dropped */
+	updateWindowTextureMemory (w);
+
 	(*w->screen->drawWindowGeometry) (w);
 
 	disableTexture (&w->texture);
@@ -538,7 +560,9 @@ paintBackground (CompScreen   *s,
     }
     else
     {
-	if (!bg->name)
+	/* a background that is still loading is drawn when it's done,
+	   root pixmap changes are picked up from property events */
+	if (!bg->name && !s->backgroundLoad)
 	    updateScreenBackground (s, bg);
     }
 
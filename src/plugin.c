@@ -61,6 +61,9 @@ initPlugin (CompPlugin *p)
 		
 		    for (w = s->windows; w; w = w->next)
 		    {
+			if (!w->pluginsInitialized)
+			    continue;
+
 			if (p->vTable->initWindow &&
 			    !(*p->vTable->initWindow) (p, w))
 			{
@@ -74,6 +77,9 @@ initPlugin (CompPlugin *p)
 		
 		    for (w = s->windows; w != failedWindow; w = w->next)
 		    {
+			if (!w->pluginsInitialized)
+			    continue;
+
 			if (p->vTable->finiWindow)
 			    (*p->vTable->finiWindow) (p, w);
 		    }
@@ -126,7 +132,8 @@ finiPlugin (CompPlugin *p)
 	    if (p->vTable->finiWindow)
 	    {
 		for (w = s->windows; w; w = w->next)
-		    (*p->vTable->finiWindow) (p, w);
+		    if (w->pluginsInitialized)
+			(*p->vTable->finiWindow) (p, w);
 	    }
 	    
 	    (*s->finiPluginForScreen) (p, s);
@@ -174,24 +181,34 @@ void
 windowInitPlugins (CompWindow *w)
 {
     CompPlugin *p;
-    
+
+    if (w->pluginsInitialized)
+	return;
+
     for (p = plugins; p; p = p->next)
     {
 	if (p->vTable->initWindow)
 	    (*p->vTable->initWindow) (p, w);
     }
+
+    w->pluginsInitialized = TRUE;
 }
 
 void
 windowFiniPlugins (CompWindow *w)
 {
     CompPlugin *p;
-    
+
+    if (!w->pluginsInitialized)
+	return;
+
     for (p = plugins; p; p = p->next)
     {
 	if (p->vTable->finiWindow)
 	    (*p->vTable->finiWindow) (p, w);
     }
+
+    w->pluginsInitialized = FALSE;
 }
 
 CompPlugin *
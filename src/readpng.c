@@ -31,31 +31,133 @@
 
 #include <comp.h>
 
+#if defined (__GNUC__) && (defined (__i386__) || defined (__x86_64__))
+#define PREMULTIPLY_SSE2
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
 #define HOME_IMAGEDIR ".glxcomp/images"
 
+/* x * a / 255 for two 8 bit channels packed in the low bytes of each
+   16 bit half, (t + 1 + (t >> 8)) >> 8 is exact for t <= 255 * 255 */
+#define MULTIPLY_CHANNELS(x, a)					    \
+    ((x) = (x) * (a),						    \
+     (x) = (((x) + 0x00010001 + (((x) >> 8) & 0x00ff00ff)) >> 8) & \
+     0x00ff00ff)
+
+typedef void (*PremultiplyProc) (unsigned char *base,
+				 unsigned char *end);
+
+static void
+premultiplyScalar (unsigned char *base,
+		   unsigned char *end)
+{
+    unsigned int rb, ag, alpha;
+
+    for (; base < end; base += 4)
+    {
+	alpha = base[3];
+
+	/* red and blue share one multiply, green the other */
+	rb = (base[2] << 16) | base[0];
+	ag = base[1];
+
+	if (alpha == 0)
+	{
+	    rb = ag = 0;
+	}
+	else if (alpha != 0xff)
+	{
+	    MULTIPLY_CHANNELS (rb, alpha);
+	    MULTIPLY_CHANNELS (ag, alpha);
+	}
+
+	ag = (alpha << 24) | (ag << 8);
+	rb |= ag;
+
+	memcpy (base, &rb, sizeof (int));
+    }
+}
+
+#ifdef PREMULTIPLY_SSE2
+
+/* four pixels at a time with the same divide as the scalar version,
+   channels are widened to 16 bits and alpha is multiplied by 255 */
+static void __attribute__ ((target ("sse2")))
+premultiplySse2 (unsigned char *base,
+		 unsigned char *end)
+{
+    __m128i zero = _mm_setzero_si128 ();
+    __m128i one = _mm_set1_epi16 (1);
+    __m128i alphaBytes = _mm_set1_epi32 (0xff000000);
+    __m128i alphaWords = _mm_set_epi16 (0xff, 0, 0, 0, 0xff, 0, 0, 0);
+    __m128i px, lo, hi, a;
+
+    for (; end - base >= 16; base += 16)
+    {
+	px = _mm_loadu_si128 ((__m128i *) base);
+
+	/* opaque wallpapers are left untouched */
+	if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (_mm_and_si128 (px, alphaBytes),
+						 alphaBytes)) == 0xffff)
+	    continue;
+
+	lo = _mm_unpacklo_epi8 (px, zero);
+	hi = _mm_unpackhi_epi8 (px, zero);
+
+	a  = _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (lo, 0xff), 0xff);
+	a  = _mm_or_si128 (_mm_andnot_si128 (alphaWords, a), alphaWords);
+	lo = _mm_mullo_epi16 (lo, a);
+	lo = _mm_add_epi16 (_mm_add_epi16 (lo, one), _mm_srli_epi16 (lo, 8));
+	lo = _mm_srli_epi16 (lo, 8);
+
+	a  = _mm_shufflehi_epi16 (_mm_shufflelo_epi16 (hi, 0xff), 0xff);
+	a  = _mm_or_si128 (_mm_andnot_si128 (alphaWords, a), alphaWords);
+	hi = _mm_mullo_epi16 (hi, a);
+	hi = _mm_add_epi16 (_mm_add_epi16 (hi, one), _mm_srli_epi16 (hi, 8));
+	hi = _mm_srli_epi16 (hi, 8);
+
+	_mm_storeu_si128 ((__m128i *) base, _mm_packus_epi16 (lo, hi));
+    }
+
+    premultiplyScalar (base, end);
+}
+
+static PremultiplyProc
+choosePremultiply (void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid (1, &eax, &ebx, &ecx, &edx) && (edx & bit_SSE2))
+	return premultiplySse2;
+
+    return premultiplyScalar;
+}
+
+#else
+
+static PremultiplyProc
+choosePremultiply (void)
+{
+    return premultiplyScalar;
+}
+
+#endif
+
 static void
 premultiplyData (png_structp   png,
 		 png_row_infop row_info,
 		 png_bytep     data)
 {
-    unsigned int i;
+    /* images are decoded on worker threads, racing here only stores
+       the same function twice */
+    static PremultiplyProc premultiply = NULL;
 
-    for (i = 0; i < row_info->rowbytes; i += 4)
-    {
-	unsigned char *base = &data[i];
-	unsigned char blue  = base[0];
-	unsigned char green = base[1];
-	unsigned char red   = base[2];
-	unsigned char alpha = base[3];
-	int	      p;
-
-	red   = (unsigned) red   * (unsigned) alpha / 255;
-	green = (unsigned) green * (unsigned) alpha / 255;
-	blue  = (unsigned) blue  * (unsigned) alpha / 255;
-
-	p = (alpha << 24) | (red << 16) | (green << 8) | (blue << 0);
-	memcpy (base, &p, sizeof (int));
-    }
+    if (!premultiply)
+	premultiply = choosePremultiply ();
+
+    (*premultiply) (data, data + row_info->rowbytes);
 }
 
 Bool
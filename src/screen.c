@@ -98,6 +98,18 @@ setScreenOption (CompScreen      *screen,
 	    screen->redrawTime = 1000 / o->value.i;
 	    return TRUE;
 	}
+	break;
+    case COMP_SCREEN_OPTION_PREBIND_WINDOWS:
+	if (compSetBoolOption (o, value))
+	    return TRUE;
+	break;
+    case COMP_SCREEN_OPTION_TEXTURE_MEMORY_LIMIT:
+	if (compSetIntOption (o, value))
+	    return TRUE;
+	break;
+    case COMP_SCREEN_OPTION_CAPTURE_FILE:
+	if (compSetStringOption (o, value))
+	    return setScreenCaptureFile (screen, o->value.s);
     default:
 	break;
     }
@@ -133,6 +145,55 @@ compScreenInitOptions (CompScreen *screen)
     o->value.i    = defaultRefreshRate;
     o->rest.i.min = 1;
     o->rest.i.max = 200;
+
+    o = &screen->opt[COMP_SCREEN_OPTION_PREBIND_WINDOWS];
+    o->name	 = "prebind_windows";
+    o->shortDesc = "Prebind Windows";
+    o->longDesc	 = "Bind the pixmaps of newly mapped windows while waiting "
+	"for the next redraw";
+    o->type	 = CompOptionTypeBool;
+    o->value.b	 = TRUE;
+
+    o = &screen->opt[COMP_SCREEN_OPTION_TEXTURE_MEMORY_LIMIT];
+    o->name       = "texture_memory_limit";
+    o->shortDesc  = "Texture Memory Limit";
+    o->longDesc   = "Release window pixmaps that haven't been painted "
+	"recently when more than this much texture memory is used "
+	"(megabytes, 0 for no limit)";
+    o->type       = CompOptionTypeInt;
+    o->value.i    = 0;
+    o->rest.i.min = 0;
+    o->rest.i.max = 4096;
+
+    o = &screen->opt[COMP_SCREEN_OPTION_TEXTURE_MEMORY];
+    o->name       = "texture_memory";
+    o->shortDesc  = "Texture Memory";
+    o->longDesc   = "Texture memory currently used for window contents "
+	"(kilobytes, read only)";
+    o->type       = CompOptionTypeInt;
+    o->value.i    = 0;
+    o->rest.i.min = 0;
+    o->rest.i.max = 4096 * 1024;
+
+    o = &screen->opt[COMP_SCREEN_OPTION_CAPTURE_FILE];
+    o->name	      = "capture_file";
+    o->shortDesc      = "Capture File";
+    o->longDesc	      = "Append each painted frame to this file as a binary "
+	"PPM image (empty to disable)";
+    o->type	      = CompOptionTypeString;
+    o->value.s	      = strdup ("");
+    o->rest.s.string  = 0;
+    o->rest.s.nString = 0;
+
+    o = &screen->opt[COMP_SCREEN_OPTION_PAINTED_PIXELS];
+    o->name       = "painted_pixels";
+    o->shortDesc  = "Painted Pixels";
+    o->longDesc   = "Number of pixels painted since start up "
+	"(thousands, read only)";
+    o->type       = CompOptionTypeInt;
+    o->value.i    = 0;
+    o->rest.i.min = 0;
+    o->rest.i.max = 0x7fffffff;
 }
 
 static Bool
@@ -263,6 +324,56 @@ getProcAddress (CompScreen *s,
     return funcPtr;
 }
 
+static void
+setBackgroundWrap (CompTexture *texture)
+{
+    if (texture->target == GL_TEXTURE_2D)
+    {
+	glBindTexture (texture->target, texture->name);
+	glTexParameteri (texture->target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri (texture->target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glBindTexture (texture->target, 0);
+    }
+}
+
+static Bool
+decodeBackgroundImage (void	    *closure,
+		       char	    **data,
+		       unsigned int *width,
+		       unsigned int *height)
+{
+    char *imageFileName = closure;
+
+    if (!readPng (imageFileName, data, width, height))
+    {
+	fprintf (stderr, "%s: Failed to load image: %s\n",
+		 programName, imageFileName);
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+backgroundImageLoaded (CompScreen   *screen,
+		       CompTexture  *texture,
+		       unsigned int width,
+		       unsigned int height,
+		       void	    *closure)
+{
+    screen->backgroundLoad = NULL;
+
+    if (!texture)
+	return;
+
+    finiTexture (screen, &screen->backgroundTexture);
+    screen->backgroundTexture = *texture;
+
+    setBackgroundWrap (&screen->backgroundTexture);
+
+    damageScreen (screen);
+}
+
 void
 updateScreenBackground (CompScreen  *screen,
 			CompTexture *texture)
@@ -320,6 +431,12 @@ updateScreenBackground (CompScreen  *screen,
 	if (pixmap == texture->pixmap)
 	    return;
 
+	if (screen->backgroundLoad)
+	{
+	    cancelImageLoad (screen, screen->backgroundLoad);
+	    screen->backgroundLoad = NULL;
+	}
+
 	finiTexture (screen, texture);
 	initTexture (screen, texture);
 
@@ -332,6 +449,17 @@ updateScreenBackground (CompScreen  *screen,
     }
     else
     {
+	/* the current background is kept until the image is loaded */
+	if (screen->backgroundLoad || texture->image)
+	    return;
+
+	screen->backgroundLoad = startImageLoad (screen,
+						 decodeBackgroundImage,
+						 backgroundImageLoaded,
+						 backgroundImage);
+	if (screen->backgroundLoad)
+	    return;
+
 	finiTexture (screen, texture);
 	initTexture (screen, texture);
     }
@@ -339,13 +467,111 @@ updateScreenBackground (CompScreen  *screen,
     if (!texture->name)
 	readImageToTexture (screen, texture, backgroundImage, &width, &height);
 
-    if (texture->target == GL_TEXTURE_2D)
+    setBackgroundWrap (texture);
+}
+
+/* pick a config without back, stencil or depth buffers for each depth
+   that pixmaps can be bound with, the texture target is chosen from
+   the supported targets when a pixmap is bound so that binding doesn't
+   need to query the server */
+static Bool
+findPixmapFBConfigs (CompScreen *s,
+		     int	defaultDepth)
+{
+    Display	 *dpy = s->display->display;
+    GLXFBConfig  *fbConfigs;
+    XVisualInfo  *visinfo;
+    CompFBConfig *config;
+    int		 attrib[] = { GLX_DRAWABLE_TYPE, GLX_PIXMAP_BIT, None };
+    int		 db[MAX_DEPTH + 1];
+    int		 stencil[MAX_DEPTH + 1];
+    int		 depthSize[MAX_DEPTH + 1];
+    int		 i, n, depth, value, format, targets;
+    int		 dbValue, stencilValue, depthValue;
+
+    for (i = 0; i <= MAX_DEPTH; i++)
     {
-	glBindTexture (texture->target, texture->name);
-	glTexParameteri (texture->target, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri (texture->target, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glBindTexture (texture->target, 0);
+	s->glxPixmapFBConfigs[i].fbConfig = NULL;
+
+	db[i] = stencil[i] = depthSize[i] = MAXSHORT;
+    }
+
+    fbConfigs = glXChooseFBConfig (dpy, s->screenNum, attrib, &n);
+    if (!fbConfigs)
+	return FALSE;
+
+    for (i = 0; i < n; i++)
+    {
+	visinfo = glXGetVisualFromFBConfig (dpy, fbConfigs[i]);
+	if (!visinfo)
+	    continue;
+
+	depth = visinfo->depth;
+	XFree (visinfo);
+
+	if (depth > MAX_DEPTH)
+	    continue;
+
+	value = 0;
+	glXGetFBConfigAttrib (dpy, fbConfigs[i], TFP_BIND_TO_TEXTURE_RGBA,
+			      &value);
+	if (value && depth == 32)
+	{
+	    format = TFP_TEXTURE_FORMAT_RGBA;
+	}
+	else
+	{
+	    value = 0;
+	    glXGetFBConfigAttrib (dpy, fbConfigs[i], TFP_BIND_TO_TEXTURE_RGB,
+				  &value);
+	    if (!value)
+		continue;
+
+	    format = TFP_TEXTURE_FORMAT_RGB;
+	}
+
+	targets = 0;
+	glXGetFBConfigAttrib (dpy, fbConfigs[i], TFP_BIND_TO_TEXTURE_TARGETS,
+			      &targets);
+	if (!(targets & (TFP_TEXTURE_2D_BIT | TFP_TEXTURE_RECTANGLE_BIT)))
+	    continue;
+
+	glXGetFBConfigAttrib (dpy, fbConfigs[i], GLX_DOUBLEBUFFER, &dbValue);
+	glXGetFBConfigAttrib (dpy, fbConfigs[i], GLX_STENCIL_SIZE,
+			      &stencilValue);
+	glXGetFBConfigAttrib (dpy, fbConfigs[i], GLX_DEPTH_SIZE, &depthValue);
+
+	if (dbValue > db[depth])
+	    continue;
+
+	if (dbValue == db[depth])
+	{
+	    if (stencilValue > stencil[depth])
+		continue;
+
+	    if (stencilValue == stencil[depth] &&
+		depthValue >= depthSize[depth])
+		continue;
+	}
+
+	db[depth]	 = dbValue;
+	stencil[depth]	 = stencilValue;
+	depthSize[depth] = depthValue;
+
+	config = &s->glxPixmapFBConfigs[depth];
+
+	config->fbConfig       = fbConfigs[i];
+	config->textureFormat  = format;
+	config->textureTargets = targets;
+
+	config->yInverted = 0;
+	glXGetFBConfigAttrib (dpy, fbConfigs[i], TFP_Y_INVERTED,
+			      &config->yInverted);
     }
+
+    XFree (fbConfigs);
+
+    return s->glxPixmapFBConfigs[defaultDepth].fbConfig != NULL;
 }
 
 Bool
@@ -371,8 +597,11 @@ addScreen (CompDisplay *display,
     if (!s)
 	return FALSE;
 
-    s->windowPrivateIndices = 0;
-    s->windowPrivateLen     = 0;
+    s->windowPrivateIndices   = 0;
+    s->windowPrivateLen       = 0;
+    s->windowPrivateSizes     = 0;
+    s->windowPrivateOffsets   = 0;
+    s->windowPrivateBlockSize = 0;
 
     if (display->screenPrivateLen)
     {
@@ -406,7 +635,25 @@ addScreen (CompDisplay *display,
     s->grabSize = 0;
     s->maxGrab  = 0;
 
-    s->pendingDestroys = 0;
+    s->pendingDestroys = NULL;
+    s->windowSlabs     = NULL;
+
+    s->stack	     = NULL;
+    s->nStack	     = 0;
+    s->mapped	     = NULL;
+    s->nMapped	     = 0;
+    s->pendingUnmaps = FALSE;
+    s->pendingBinds  = FALSE;
+    s->stackSize     = 0;
+    s->textureMemory = 0;
+    s->frameCount    = 0;
+    s->paintedPixels = 0;
+    s->images	     = NULL;
+
+    s->imageLoads     = NULL;
+    s->backgroundLoad = NULL;
+    s->captures       = NULL;
+    s->fileSink       = NULL;
 
     s->screenNum = screenNum;
     s->colormap  = DefaultColormap (dpy, screenNum);
@@ -679,6 +926,8 @@ addScreen (CompDisplay *display,
     glXMakeCurrent (dpy, s->root, s->ctx);
     currentRoot = s->root;
 
+    s->textureFromPixmap = TRUE;
+
     glxExtensions = glXQueryExtensionsString (s->display->display, screenNum);
     if (!testMode && !strstr (glxExtensions, "GLX_MESA_render_texture")
         && !strstr(glxExtensions, "GLX_EXT_texture_from_drawable")
@@ -686,7 +935,7 @@ addScreen (CompDisplay *display,
     {
 	fprintf (stderr, "%s: GLX_MESA_render_texture is missing\n",
 		 programName);
-	return FALSE;
+	s->textureFromPixmap = FALSE;
     }
 
     s->getProcAddress = (GLXGetProcAddressProc)
@@ -703,26 +952,46 @@ addScreen (CompDisplay *display,
     s->queryDrawable = (GLXQueryDrawableProc)
 	getProcAddress (s, "glXQueryDrawable");
 
-    if (!testMode && !s->bindTexImageExt && !s->bindTexImageMesa)
+    s->useFBConfigs = FALSE;
+    if (!testMode && s->textureFromPixmap && s->bindTexImageExt &&
+	strstr (glxExtensions, "GLX_EXT_texture_from_pixmap"))
     {
-	fprintf (stderr, "%s: glXBindTexImage{EXT,MESA} are missing\n",
-                 programName);
-	return FALSE;
-    }
+	int major, minor;
 
-    if (!testMode && !s->releaseTexImage)
-    {
-	fprintf (stderr, "%s: glXReleaseTexImage{EXT,MESA} are missing\n",
-		 programName);
-	return FALSE;
+	if (glXQueryVersion (dpy, &major, &minor) &&
+	    (major > 1 || (major == 1 && minor >= 3)))
+	    s->useFBConfigs = findPixmapFBConfigs (s, defaultDepth);
     }
 
-    if (!testMode && !s->queryDrawable)
+    if (!testMode && s->textureFromPixmap)
     {
-	fprintf (stderr, "%s: glXQueryDrawable is missing\n", programName);
-	return FALSE;
+	if (!s->bindTexImageExt && !s->bindTexImageMesa)
+	{
+	    fprintf (stderr, "%s: glXBindTexImage{EXT,MESA} are missing\n",
+		     programName);
+	    s->textureFromPixmap = FALSE;
+	}
+	else if (!s->releaseTexImage)
+	{
+	    fprintf (stderr, "%s: glXReleaseTexImage{EXT,MESA} are missing\n",
+		     programName);
+	    s->textureFromPixmap = FALSE;
+	}
+	else if (!s->queryDrawable && !s->useFBConfigs)
+	{
+	    fprintf (stderr, "%s: glXQueryDrawable is missing\n",
+		     programName);
+	    s->textureFromPixmap = FALSE;
+	}
     }
 
+    if (!s->textureFromPixmap)
+	s->useFBConfigs = FALSE;
+
+    if (!testMode && !s->textureFromPixmap)
+	fprintf (stderr, "%s: Copying window contents to textures, "
+		 "this is going to be slow\n", programName);
+
     s->textureRectangle = 0;
     glExtensions = (const char *) glGetString (GL_EXTENSIONS);
     if (strstr (glExtensions, "GL_NV_texture_rectangle")  ||
@@ -757,6 +1026,55 @@ addScreen (CompDisplay *display,
 	    glGetIntegerv (GL_MAX_TEXTURE_UNITS_ARB, &s->maxTextureUnits);
     }
 
+    s->fbo = 0;
+    s->mipmapFbo = 0;
+    if (strstr (glExtensions, "GL_EXT_framebuffer_object"))
+    {
+	s->generateMipmap = (GLGenerateMipmapProc)
+	    getProcAddress (s, "glGenerateMipmapEXT");
+	s->genFramebuffers = (GLGenFramebuffersProc)
+	    getProcAddress (s, "glGenFramebuffersEXT");
+	s->bindFramebuffer = (GLBindFramebufferProc)
+	    getProcAddress (s, "glBindFramebufferEXT");
+	s->framebufferTexture2D = (GLFramebufferTexture2DProc)
+	    getProcAddress (s, "glFramebufferTexture2DEXT");
+	s->checkFramebufferStatus = (GLCheckFramebufferStatusProc)
+	    getProcAddress (s, "glCheckFramebufferStatusEXT");
+
+	if (s->generateMipmap	    &&
+	    s->genFramebuffers	    &&
+	    s->bindFramebuffer	    &&
+	    s->framebufferTexture2D &&
+	    s->checkFramebufferStatus)
+	    s->fbo = 1;
+    }
+
+    s->pbo = 0;
+    if (strstr (glExtensions, "GL_ARB_pixel_buffer_object") ||
+	strstr (glExtensions, "GL_EXT_pixel_buffer_object"))
+    {
+	s->genBuffers = (GLGenBuffersProc)
+	    getProcAddress (s, "glGenBuffersARB");
+	s->deleteBuffers = (GLDeleteBuffersProc)
+	    getProcAddress (s, "glDeleteBuffersARB");
+	s->bindBuffer = (GLBindBufferProc)
+	    getProcAddress (s, "glBindBufferARB");
+	s->bufferData = (GLBufferDataProc)
+	    getProcAddress (s, "glBufferDataARB");
+	s->mapBuffer = (GLMapBufferProc)
+	    getProcAddress (s, "glMapBufferARB");
+	s->unmapBuffer = (GLUnmapBufferProc)
+	    getProcAddress (s, "glUnmapBufferARB");
+
+	if (s->genBuffers    &&
+	    s->deleteBuffers &&
+	    s->bindBuffer    &&
+	    s->bufferData    &&
+	    s->mapBuffer     &&
+	    s->unmapBuffer)
+	    s->pbo = 1;
+    }
+
     initTexture (s, &s->backgroundTexture);
 
     s->desktopWindowCount = 0;
@@ -878,10 +1196,95 @@ findClientWindowAtScreen (CompScreen *s,
     return 0;
 }
 
+static int
+findWindowInArray (CompWindow **array,
+		   int	      n,
+		   CompWindow *w)
+{
+    int i;
+
+    for (i = n - 1; i >= 0; i--)
+	if (array[i] == w)
+	    return i;
+
+    return -1;
+}
+
+static void
+insertWindowIntoArray (CompWindow **array,
+		       int	  *n,
+		       int	  index,
+		       CompWindow *w)
+{
+    memmove (array + index + 1, array + index,
+	     (*n - index) * sizeof (CompWindow *));
+
+    array[index] = w;
+    (*n)++;
+}
+
+static void
+removeWindowFromArray (CompWindow **array,
+		       int	  *n,
+		       CompWindow *w)
+{
+    int i;
+
+    i = findWindowInArray (array, *n, w);
+    if (i < 0)
+	return;
+
+    (*n)--;
+
+    memmove (array + i, array + i + 1, (*n - i) * sizeof (CompWindow *));
+}
+
+/* the stack and mapped arrays are sized for every window slot that
+   has been allocated so they never need to grow here */
 void
-insertWindowIntoScreen (CompScreen *s,
-			CompWindow *w,
-			Window	   aboveId)
+insertMappedWindow (CompScreen *s,
+		    CompWindow *w)
+{
+    CompWindow *p;
+    int	       i = 0;
+
+    if (findWindowInArray (s->mapped, s->nMapped, w) >= 0)
+	return;
+
+    for (p = w->prev; p; p = p->prev)
+    {
+	if (p->attrib.map_state == IsViewable)
+	{
+	    i = findWindowInArray (s->mapped, s->nMapped, p) + 1;
+	    break;
+	}
+    }
+
+    insertWindowIntoArray (s->mapped, &s->nMapped, i, w);
+}
+
+/* windows are not removed from the mapped array in unmapWindow as
+   that can happen while the array is being walked by paint code */
+void
+updateMappedWindows (CompScreen *s)
+{
+    int i, n = 0;
+
+    if (!s->pendingUnmaps)
+	return;
+
+    for (i = 0; i < s->nMapped; i++)
+	if (s->mapped[i]->attrib.map_state == IsViewable)
+	    s->mapped[n++] = s->mapped[i];
+
+    s->nMapped = n;
+    s->pendingUnmaps = FALSE;
+}
+
+static void
+linkWindowIntoScreen (CompScreen *s,
+		      CompWindow *w,
+		      Window	 aboveId)
 {
     CompWindow *p;
 
@@ -922,38 +1325,43 @@ insertWindowIntoScreen (CompScreen *s,
     }
 }
 
+void
+insertWindowIntoScreen (CompScreen *s,
+			CompWindow *w,
+			Window	   aboveId)
+{
+    int i = 0;
+
+    linkWindowIntoScreen (s, w, aboveId);
+
+    if (w->prev)
+	i = findWindowInArray (s->stack, s->nStack, w->prev) + 1;
+
+    insertWindowIntoArray (s->stack, &s->nStack, i, w);
+
+    if (w->attrib.map_state == IsViewable)
+	insertMappedWindow (s, w);
+}
+
 void
 unhookWindowFromScreen (CompScreen *s,
 			CompWindow *w)
 {
-    CompWindow *p;
+    removeWindowFromArray (s->stack, &s->nStack, w);
+    removeWindowFromArray (s->mapped, &s->nMapped, w);
 
-    if (s->windows == w)
-    {
-	s->windows = w->next;
-	if (w->next)
-	    w->next->prev = NULL;
-    }
-
-    if (s->reverseWindows == w)
-    {
+    if (w->next)
+	w->next->prev = w->prev;
+    else
 	s->reverseWindows = w->prev;
-	if (w->prev)
-	    w->prev->next = NULL;
-    }
 
-    for (p = s->windows; p; p = p->next)
-    {
-	if (p->next == w)
-	{
-	    p->next = w->next;
-	    if (w->next)
-		w->next->prev = p;
+    if (w->prev)
+	w->prev->next = w->next;
+    else
+	s->windows = w->next;
 
-	    p->next = w->next;
-	    break;
-	}
-    }
+    w->next = NULL;
+    w->prev = NULL;
 }
 
 #define POINTER_GRAB_MASK (ButtonReleaseMask | \
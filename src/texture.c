@@ -26,15 +26,179 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
 
 #include <comp.h>
 
+/* fetch the extents instead when damage is split into more rectangles */
+#define MAX_COPY_RECTS 16
+
 static CompMatrix _identity_matrix = {
     1, 0,
     0, 1,
     0, 0
 };
 
+/* decoded images are kept in one texture per screen that is shared
+   by all textures loaded from the same file. the file's identity and
+   modification time are part of the key so a file that has been
+   replaced or edited is loaded again. */
+struct _CompImage {
+    CompImage	      *next;
+    char	      *name;
+    dev_t	      dev;
+    ino_t	      ino;
+    off_t	      size;
+    time_t	      mtime;
+    int		      refCount;
+    GLuint	      texture;
+    GLenum	      target;
+    CompMatrix	      matrix;
+    CompTextureFilter filter;
+    unsigned int      width;
+    unsigned int      height;
+};
+
+/* rows are stored top to bottom so the matrix doesn't flip */
+static GLenum
+imageTarget (CompScreen   *screen,
+	     unsigned int width,
+	     unsigned int height,
+	     CompMatrix   *matrix)
+{
+    *matrix = _identity_matrix;
+
+    if (screen->textureNonPowerOfTwo ||
+	(POWER_OF_TWO (width) && POWER_OF_TWO (height)))
+    {
+	matrix->xx = 1.0f / width;
+	matrix->yy = 1.0f / height;
+
+	return GL_TEXTURE_2D;
+    }
+
+    return GL_TEXTURE_RECTANGLE_NV;
+}
+
+static CompImage *
+loadImage (CompScreen *screen,
+	   char	      *imageFileName)
+{
+    CompImage	 *image;
+    char	 *data;
+    unsigned int width, height;
+    struct stat  st;
+
+    if (stat (imageFileName, &st))
+    {
+	fprintf (stderr, "%s: Failed to load image: %s\n",
+		 programName, imageFileName);
+	return NULL;
+    }
+
+    for (image = screen->images; image; image = image->next)
+    {
+	if (strcmp (image->name, imageFileName) == 0 &&
+	    image->dev   == st.st_dev		     &&
+	    image->ino   == st.st_ino		     &&
+	    image->size  == st.st_size		     &&
+	    image->mtime == st.st_mtime)
+	{
+	    image->refCount++;
+	    return image;
+	}
+    }
+
+    if (!readPng (imageFileName, &data, &width, &height))
+    {
+	fprintf (stderr, "%s: Failed to load image: %s\n",
+		 programName, imageFileName);
+	return NULL;
+    }
+
+    image = malloc (sizeof (CompImage) + strlen (imageFileName) + 1);
+    if (!image)
+    {
+	free (data);
+	return NULL;
+    }
+
+    image->name = (char *) (image + 1);
+    strcpy (image->name, imageFileName);
+
+    image->dev	    = st.st_dev;
+    image->ino	    = st.st_ino;
+    image->size	    = st.st_size;
+    image->mtime    = st.st_mtime;
+    image->refCount = 1;
+    image->width    = width;
+    image->height   = height;
+    image->target   = imageTarget (screen, width, height, &image->matrix);
+
+    glGenTextures (1, &image->texture);
+
+    glBindTexture (image->target, image->texture);
+
+    glTexImage2D (image->target, 0, GL_RGB, width, height, 0, GL_BGRA,
+
+#if IMAGE_BYTE_ORDER == MSBFirst
+		  GL_UNSIGNED_INT_8_8_8_8_REV,
+#else
+		  GL_UNSIGNED_BYTE,
+#endif
+
+		  data);
+
+    image->filter = COMP_TEXTURE_FILTER_FAST;
+
+    glTexParameteri (image->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri (image->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glTexParameteri (image->target, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri (image->target, GL_TEXTURE_WRAP_T, GL_CLAMP);
+
+    glBindTexture (image->target, 0);
+
+    free (data);
+
+    image->next = screen->images;
+    screen->images = image;
+
+    return image;
+}
+
+static void
+releaseTextureImage (CompScreen  *screen,
+		     CompTexture *texture)
+{
+    CompImage *image = texture->image;
+    CompImage **prev;
+
+    if (!image)
+	return;
+
+    texture->image = NULL;
+    texture->name  = 0;
+
+    if (--image->refCount)
+	return;
+
+    for (prev = &screen->images; *prev; prev = &(*prev)->next)
+    {
+	if (*prev == image)
+	{
+	    *prev = image->next;
+	    break;
+	}
+    }
+
+    glDeleteTextures (1, &image->texture);
+
+    free (image);
+}
+
 void
 initTexture (CompScreen  *screen,
 	     CompTexture *texture)
@@ -44,13 +208,28 @@ initTexture (CompScreen  *screen,
     texture->pixmap = None;
     texture->filter = COMP_TEXTURE_FILTER_FAST;
     texture->matrix = _identity_matrix;
+    texture->image  = NULL;
+    texture->damage = NULL;
+    texture->width  = 0;
+    texture->height = 0;
+    texture->depth  = 0;
+    texture->mipmap = 0;
+
+    texture->mipmapDamaged = FALSE;
+
+    texture->shmInfo.shmid   = -1;
+    texture->shmInfo.shmaddr = NULL;
 }
 
 void
 finiTexture (CompScreen  *screen,
 	     CompTexture *texture)
 {
-    if (texture->name)
+    if (texture->image)
+    {
+	releaseTextureImage (screen, texture);
+    }
+    else if (texture->name)
     {
 	releasePixmapFromTexture (screen, texture);
 	glDeleteTextures (1, &texture->name);
@@ -64,82 +243,599 @@ readImageToTexture (CompScreen   *screen,
 		    unsigned int *returnWidth,
 		    unsigned int *returnHeight)
 {
-    char	 *data, *image;
-    unsigned int width, height;
-    int		 i;
+    CompImage *image;
+
+    image = loadImage (screen, imageFileName);
+    if (!image)
+	return FALSE;
+
+    releasePixmapFromTexture (screen, texture);
+
+    if (texture->image)
+	releaseTextureImage (screen, texture);
+    else if (texture->name)
+	glDeleteTextures (1, &texture->name);
+
+    texture->image  = image;
+    texture->name   = image->texture;
+    texture->target = image->target;
+    texture->matrix = image->matrix;
 
-    if (!readPng (imageFileName, &image, &width, &height))
+    *returnWidth = image->width;
+    *returnHeight = image->height;
+
+    return TRUE;
+}
+
+/* upper limit for the amount of pixel data uploaded by each call to
+   uploadImages, larger images are uploaded over multiple frames */
+#define MAX_UPLOAD_BYTES (4 << 20)
+
+struct _CompImageLoad {
+    CompImageLoad   *next;
+    CompScreen	    *screen;
+    CompWorkHandle  handle;
+    DecodeImageProc decode;
+    ImageLoadedProc loaded;
+    void	    *closure;
+    Bool	    decoded;
+    char	    *data;
+    unsigned int    width;
+    unsigned int    height;
+    unsigned int    row;
+    CompTexture     texture;
+};
+
+static void
+unlinkImageLoad (CompScreen    *screen,
+		 CompImageLoad *load)
+{
+    CompImageLoad **prev;
+
+    for (prev = &screen->imageLoads; *prev; prev = &(*prev)->next)
     {
-	fprintf (stderr, "%s: Failed to load image: %s\n",
-		 programName, imageFileName);
+	if (*prev == load)
+	{
+	    *prev = load->next;
+	    break;
+	}
+    }
+}
+
+static void
+decodeImage (void *closure)
+{
+    CompImageLoad *load = closure;
+
+    load->decoded = (*load->decode) (load->closure, &load->data,
+				     &load->width, &load->height);
+    if (!load->decoded)
+	load->data = NULL;
+    else if (!load->width || !load->height)
+    {
+	free (load->data);
+	load->data = NULL;
+	load->decoded = FALSE;
+    }
+}
+
+static void
+imageDecoded (void *closure)
+{
+    CompImageLoad *load = closure;
+
+    load->handle = 0;
+
+    if (load->decoded)
+	return;
+
+    unlinkImageLoad (load->screen, load);
+
+    (*load->loaded) (load->screen, NULL, 0, 0, load->closure);
+
+    free (load);
+}
+
+/* decodes an image on the worker thread and uploads it to a new
+   texture in the background, the loaded proc is called from the main
+   thread once the texture is complete so the texture it replaces can
+   be used until then */
+CompImageLoad *
+startImageLoad (CompScreen	*screen,
+		DecodeImageProc decode,
+		ImageLoadedProc loaded,
+		void		*closure)
+{
+    CompImageLoad *load;
+
+    load = malloc (sizeof (CompImageLoad));
+    if (!load)
+	return NULL;
+
+    load->screen  = screen;
+    load->decode  = decode;
+    load->loaded  = loaded;
+    load->closure = closure;
+    load->decoded = FALSE;
+    load->data    = NULL;
+    load->width   = 0;
+    load->height  = 0;
+    load->row     = 0;
+
+    initTexture (screen, &load->texture);
+
+    load->handle = compAddWork (decodeImage, imageDecoded, load);
+    if (!load->handle)
+    {
+	free (load);
+	return NULL;
+    }
+
+    load->next = screen->imageLoads;
+    screen->imageLoads = load;
+
+    return load;
+}
+
+void
+cancelImageLoad (CompScreen    *screen,
+		 CompImageLoad *load)
+{
+    if (load->handle)
+	compRemoveWork (load->handle);
+
+    unlinkImageLoad (screen, load);
+
+    if (load->data)
+	free (load->data);
+
+    finiTexture (screen, &load->texture);
+
+    free (load);
+}
+
+static Bool
+uploadImageRows (CompScreen    *screen,
+		 CompImageLoad *load)
+{
+    CompTexture  *texture = &load->texture;
+    unsigned int rows;
+
+    if (!texture->name)
+    {
+	texture->target = imageTarget (screen, load->width, load->height,
+				       &texture->matrix);
+
+	glGenTextures (1, &texture->name);
+
+	glBindTexture (texture->target, texture->name);
+
+	glTexImage2D (texture->target, 0, GL_RGB, load->width, load->height,
+		      0, GL_BGRA,
+
+#if IMAGE_BYTE_ORDER == MSBFirst
+		      GL_UNSIGNED_INT_8_8_8_8_REV,
+#else
+		      GL_UNSIGNED_BYTE,
+#endif
+
+		      NULL);
+
+	glTexParameteri (texture->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri (texture->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glTexParameteri (texture->target, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri (texture->target, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    }
+    else
+    {
+	glBindTexture (texture->target, texture->name);
+    }
+
+    rows = MAX_UPLOAD_BYTES / (load->width * 4);
+    if (rows < 1)
+	rows = 1;
+
+    if (rows > load->height - load->row)
+	rows = load->height - load->row;
+
+    glTexSubImage2D (texture->target, 0, 0, load->row, load->width, rows,
+		     GL_BGRA,
+
+#if IMAGE_BYTE_ORDER == MSBFirst
+		     GL_UNSIGNED_INT_8_8_8_8_REV,
+#else
+		     GL_UNSIGNED_BYTE,
+#endif
+
+		     load->data + load->row * load->width * 4);
+
+    glBindTexture (texture->target, 0);
+
+    load->row += rows;
+
+    return load->row == load->height;
+}
+
+/* uploads the next part of a decoded image, returns TRUE when there's
+   more left to upload */
+Bool
+uploadImages (CompScreen *screen)
+{
+    CompImageLoad *load;
+
+    /* loads still owned by the worker thread have a handle */
+    for (load = screen->imageLoads; load; load = load->next)
+	if (!load->handle)
+	    break;
+
+    if (!load)
+	return FALSE;
+
+    if (uploadImageRows (screen, load))
+    {
+	unlinkImageLoad (screen, load);
+
+	free (load->data);
+
+	(*load->loaded) (screen, &load->texture, load->width, load->height,
+			 load->closure);
+
+	free (load);
+
+	for (load = screen->imageLoads; load; load = load->next)
+	    if (!load->handle)
+		return TRUE;
+
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+attachTextureShm (CompScreen  *screen,
+		  CompTexture *texture)
+{
+    Display *dpy = screen->display->display;
+    int	    size = texture->width * texture->height * 4;
+
+    texture->shmInfo.shmid = shmget (IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (texture->shmInfo.shmid < 0)
+	return;
+
+    texture->shmInfo.shmaddr = shmat (texture->shmInfo.shmid, 0, 0);
+    if (texture->shmInfo.shmaddr == (char *) -1)
+    {
+	shmctl (texture->shmInfo.shmid, IPC_RMID, 0);
+	texture->shmInfo.shmaddr = NULL;
+	return;
+    }
+
+    texture->shmInfo.readOnly = FALSE;
+
+    compCheckForError ();
+
+    XShmAttach (dpy, &texture->shmInfo);
+    XSync (dpy, FALSE);
+
+    /* segment goes away when both we and the server have detached */
+    shmctl (texture->shmInfo.shmid, IPC_RMID, 0);
+
+    if (compCheckForError ())
+    {
+	shmdt (texture->shmInfo.shmaddr);
+	texture->shmInfo.shmaddr = NULL;
+    }
+}
+
+/* images of the pixmap's depth are uploaded as they come from the
+   server, FALSE when their layout has no matching format and type */
+static Bool
+pixmapImageFormat (CompScreen  *screen,
+		   CompTexture *texture,
+		   XVisualInfo *visinfo,
+		   int	       depth)
+{
+    Display		*dpy = screen->display->display;
+    XPixmapFormatValues *formats;
+    unsigned long	red = visinfo->red_mask;
+    unsigned long	blue = visinfo->blue_mask;
+    int			n, i, bpp = 0, one = 1;
+    Bool		msbImage, swap;
+
+    formats = XListPixmapFormats (dpy, &n);
+    if (formats)
+    {
+	for (i = 0; i < n; i++)
+	    if (formats[i].depth == depth)
+		bpp = formats[i].bits_per_pixel;
+
+	XFree (formats);
+    }
+
+    /* packed pixels are read in host byte order */
+    msbImage = (ImageByteOrder (dpy) == MSBFirst);
+    swap     = (msbImage == (*(char *) &one != 0));
+
+    texture->swapBytes = FALSE;
+
+    switch (bpp) {
+    case 32:
+	if (red == 0xff0000 && blue == 0xff)
+	    texture->format = GL_BGRA;
+	else if (red == 0xff && blue == 0xff0000)
+	    texture->format = GL_RGBA;
+	else
+	    return FALSE;
+
+	texture->type	   = GL_UNSIGNED_INT_8_8_8_8_REV;
+	texture->swapBytes = swap;
+	break;
+    case 24:
+	if (red == 0xff0000 && blue == 0xff)
+	    texture->format = msbImage ? GL_RGB : GL_BGR;
+	else if (red == 0xff && blue == 0xff0000)
+	    texture->format = msbImage ? GL_BGR : GL_RGB;
+	else
+	    return FALSE;
+
+	texture->type = GL_UNSIGNED_BYTE;
+	break;
+    case 16:
+	texture->format = GL_RGB;
+
+	if (red == 0xf800 && blue == 0x1f)
+	    texture->type = GL_UNSIGNED_SHORT_5_6_5;
+	else if (red == 0x1f && blue == 0xf800)
+	    texture->type = GL_UNSIGNED_SHORT_5_6_5_REV;
+	else if (red == 0x7c00 && blue == 0x1f)
+	{
+	    /* the unused top bit is read as alpha and ignored */
+	    texture->format = GL_BGRA;
+	    texture->type   = GL_UNSIGNED_SHORT_1_5_5_5_REV;
+	}
+	else
+	    return FALSE;
+
+	texture->swapBytes = swap;
+	break;
+    default:
 	return FALSE;
     }
 
-    data = malloc (4 * width * height);
-    if (!data)
+    return TRUE;
+}
+
+/* fallback for when texture_from_pixmap isn't available, pixmap
+   contents are copied to the texture and kept up to date by copying
+   damaged rectangles in updatePixmapTexture */
+static Bool
+copyPixmapToTexture (CompScreen  *screen,
+		     CompTexture *texture,
+		     Pixmap	 pixmap,
+		     int	 width,
+		     int	 height,
+		     int	 depth)
+{
+    REGION region;
+
+    if (!pixmapImageFormat (screen, texture,
+			    screen->glxPixmapVisuals[depth], depth))
     {
-	free (image);
+	fprintf (stderr, "%s: No image format for copying pixmaps of "
+		 "depth %d\n", programName, depth);
+
 	return FALSE;
     }
 
-    for (i = 0; i < height; i++)
-	memcpy (&data[i * width * 4],
-		&image[(height - i - 1) * width * 4],
-		width * 4);
+    texture->damage = XCreateRegion ();
+    if (!texture->damage)
+	return FALSE;
 
-    free (image);
+    texture->pixmap = pixmap;
+    texture->width  = width;
+    texture->height = height;
+    texture->depth  = depth;
 
-    releasePixmapFromTexture (screen, texture);
+    if (screen->display->shmExtension)
+	attachTextureShm (screen, texture);
 
+    /* rows are copied top to bottom so no flip is needed */
     if (screen->textureNonPowerOfTwo ||
 	(POWER_OF_TWO (width) && POWER_OF_TWO (height)))
     {
 	texture->target = GL_TEXTURE_2D;
 	texture->matrix.xx = 1.0f / width;
-	texture->matrix.yy = -1.0f / height;
-	texture->matrix.y0 = 1.0f;
+	texture->matrix.yy = 1.0f / height;
     }
     else
     {
 	texture->target = GL_TEXTURE_RECTANGLE_NV;
 	texture->matrix.xx = 1.0f;
-	texture->matrix.yy = -1.0f;
-	texture->matrix.y0 = height;
+	texture->matrix.yy = 1.0f;
     }
 
+    texture->matrix.x0 = 0.0f;
+    texture->matrix.y0 = 0.0f;
+
     if (!texture->name)
 	glGenTextures (1, &texture->name);
 
     glBindTexture (texture->target, texture->name);
 
-    glTexImage2D (texture->target, 0, GL_RGB, width, height, 0, GL_BGRA,
-
-#if IMAGE_BYTE_ORDER == MSBFirst
-		  GL_UNSIGNED_INT_8_8_8_8_REV,
-#else
-		  GL_UNSIGNED_BYTE,
-#endif
-
-		  data);
+    glTexImage2D (texture->target, 0, (depth == 32) ? GL_RGBA : GL_RGB,
+		  width, height, 0, texture->format, texture->type, NULL);
 
     texture->filter = COMP_TEXTURE_FILTER_FAST;
 
     glTexParameteri (texture->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri (texture->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-    glTexParameteri (texture->target, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameteri (texture->target, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    glTexParameteri (texture->target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri (texture->target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
     glBindTexture (texture->target, 0);
 
-    free (data);
+    region.rects    = &region.extents;
+    region.numRects = region.size = 1;
 
-    *returnWidth = width;
-    *returnHeight = height;
+    region.extents.x1 = 0;
+    region.extents.y1 = 0;
+    region.extents.x2 = width;
+    region.extents.y2 = height;
+
+    XUnionRegion (&region, texture->damage, texture->damage);
+
+    updatePixmapTexture (screen, texture);
 
     return TRUE;
 }
 
+void
+updatePixmapTexture (CompScreen  *screen,
+		     CompTexture *texture)
+{
+    Display	*dpy = screen->display->display;
+    XVisualInfo *visinfo;
+    XImage	*image;
+    REGION	bounds;
+    BoxPtr	pBox;
+    int		nBox, x, y, width, height;
+
+    if (!texture->damage || !REGION_NOT_EMPTY (texture->damage))
+	return;
+
+    visinfo = screen->glxPixmapVisuals[texture->depth];
+
+    bounds.rects    = &bounds.extents;
+    bounds.numRects = bounds.size = 1;
+
+    bounds.extents.x1 = 0;
+    bounds.extents.y1 = 0;
+    bounds.extents.x2 = texture->width;
+    bounds.extents.y2 = texture->height;
+
+    XIntersectRegion (texture->damage, &bounds, texture->damage);
+
+    pBox = texture->damage->rects;
+    nBox = texture->damage->numRects;
+
+    if (nBox > MAX_COPY_RECTS)
+    {
+	pBox = &texture->damage->extents;
+	nBox = 1;
+    }
+
+    glBindTexture (texture->target, texture->name);
+
+    glPixelStorei (GL_UNPACK_SWAP_BYTES, texture->swapBytes);
+
+    while (nBox--)
+    {
+	x      = pBox->x1;
+	y      = pBox->y1;
+	width  = pBox->x2 - pBox->x1;
+	height = pBox->y2 - pBox->y1;
+
+	pBox++;
+
+	if (texture->shmInfo.shmaddr)
+	{
+	    image = XShmCreateImage (dpy, visinfo->visual,
+				     texture->depth, ZPixmap,
+				     texture->shmInfo.shmaddr,
+				     &texture->shmInfo,
+				     width, height);
+	    if (image && !XShmGetImage (dpy, texture->pixmap, image, x, y,
+					AllPlanes))
+	    {
+		XDestroyImage (image);
+		image = NULL;
+	    }
+	}
+	else
+	    image = XGetImage (dpy, texture->pixmap, x, y, width, height,
+			       AllPlanes, ZPixmap);
+
+	if (!image)
+	    continue;
+
+	/* rows are padded to the scanline pad, which is how GL aligns
+	   rows when no row length is given */
+	glPixelStorei (GL_UNPACK_ALIGNMENT, image->bitmap_pad / 8);
+
+	glTexSubImage2D (texture->target, 0, x, y, width, height,
+			 texture->format, texture->type, image->data);
+
+	XDestroyImage (image);
+    }
+
+    glPixelStorei (GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei (GL_UNPACK_SWAP_BYTES, GL_FALSE);
+
+    glBindTexture (texture->target, 0);
+
+    EMPTY_REGION (texture->damage);
+}
+
+static GLXPixmap
+createFBConfigPixmap (CompScreen   *screen,
+		      Pixmap	   pixmap,
+		      int	   width,
+		      int	   height,
+		      int	   depth,
+		      unsigned int *target,
+		      int	   *yInverted)
+{
+    CompFBConfig *config = &screen->glxPixmapFBConfigs[depth];
+    int		 attribs[5];
+
+    if (!config->fbConfig)
+    {
+	fprintf (stderr, "%s: No GLXFBConfig for depth %d\n",
+		 programName, depth);
+
+	return None;
+    }
+
+    if ((config->textureTargets & TFP_TEXTURE_2D_BIT) &&
+	(screen->textureNonPowerOfTwo ||
+	 (POWER_OF_TWO (width) && POWER_OF_TWO (height))))
+	*target = GLX_TEXTURE_2D_EXT;
+    else if (config->textureTargets & TFP_TEXTURE_RECTANGLE_BIT)
+	*target = GLX_TEXTURE_RECTANGLE_EXT;
+    else
+    {
+	fprintf (stderr, "%s: pixmap 0x%x can't be bound to texture\n",
+		 programName, (int) pixmap);
+
+	return None;
+    }
+
+    attribs[0] = TFP_TEXTURE_TARGET;
+    attribs[1] = (*target == GLX_TEXTURE_2D_EXT) ?
+	TFP_TEXTURE_2D : TFP_TEXTURE_RECTANGLE;
+    attribs[2] = TFP_TEXTURE_FORMAT;
+    attribs[3] = config->textureFormat;
+    attribs[4] = None;
+
+    *yInverted = config->yInverted;
+
+    return glXCreatePixmap (screen->display->display, config->fbConfig,
+			    pixmap, attribs);
+}
+
+static void
+destroyGLXPixmap (CompScreen *screen,
+		  GLXPixmap  pixmap)
+{
+    if (screen->useFBConfigs)
+	glXDestroyPixmap (screen->display->display, pixmap);
+    else
+	glXDestroyGLXPixmap (screen->display->display, pixmap);
+}
+
 Bool
 bindPixmapToTexture (CompScreen  *screen,
 		     CompTexture *texture,
@@ -149,58 +845,96 @@ bindPixmapToTexture (CompScreen  *screen,
 		     int	 depth)
 {
     XVisualInfo  *visinfo;
-    unsigned int target;
+    unsigned int target = 0;
+    int		 yInverted = 0;
     int success = 0;
 
-    visinfo = screen->glxPixmapVisuals[depth];
-    if (!visinfo)
+    releaseTextureImage (screen, texture);
+
+    if (screen->useFBConfigs)
     {
-	fprintf (stderr, "%s: No GL visual for depth %d\n",
-		 programName, depth);
+	texture->pixmap = createFBConfigPixmap (screen, pixmap,
+						width, height, depth,
+						&target, &yInverted);
+	if (!texture->pixmap)
+	{
+	    fprintf (stderr, "%s: glXCreatePixmap failed\n", programName);
 
-	return FALSE;
+	    return FALSE;
+	}
     }
-
-    texture->pixmap = glXCreateGLXPixmap (screen->display->display,
-					  visinfo, pixmap);
-    if (!texture->pixmap)
+    else
     {
-	fprintf (stderr, "%s: glXCreateGLXPixmap failed\n", programName);
+	visinfo = screen->glxPixmapVisuals[depth];
+	if (!visinfo)
+	{
+	    fprintf (stderr, "%s: No GL visual for depth %d\n",
+		     programName, depth);
 
-	return FALSE;
-    }
+	    return FALSE;
+	}
 
-    if (screen->queryDrawable (screen->display->display,
-			       texture->pixmap,
-			       GLX_TEXTURE_TARGET_EXT,
-			       &target))
-    {
-	fprintf (stderr, "%s: glXQueryDrawable failed\n", programName);
+	if (!screen->textureFromPixmap)
+	    return copyPixmapToTexture (screen, texture, pixmap,
+					width, height, depth);
 
-	glXDestroyGLXPixmap (screen->display->display, texture->pixmap);
-	texture->pixmap = None;
+	texture->pixmap = glXCreateGLXPixmap (screen->display->display,
+					      visinfo, pixmap);
+	if (!texture->pixmap)
+	{
+	    fprintf (stderr, "%s: glXCreateGLXPixmap failed\n", programName);
 
-	return FALSE;
+	    return FALSE;
+	}
+
+	if (screen->queryDrawable (screen->display->display,
+				   texture->pixmap,
+				   GLX_TEXTURE_TARGET_EXT,
+				   &target))
+	{
+	    fprintf (stderr, "%s: glXQueryDrawable failed\n", programName);
+
+	    glXDestroyGLXPixmap (screen->display->display, texture->pixmap);
+	    texture->pixmap = None;
+
+	    return FALSE;
+	}
     }
 
+    texture->matrix = _identity_matrix;
+
     switch (target) {
     case GLX_TEXTURE_2D_EXT:
 	texture->target = GL_TEXTURE_2D;
 	texture->matrix.xx = 1.0f / width;
-	texture->matrix.yy = -1.0f / height;
-	texture->matrix.y0 = 1.0f;
+	if (yInverted)
+	{
+	    texture->matrix.yy = 1.0f / height;
+	}
+	else
+	{
+	    texture->matrix.yy = -1.0f / height;
+	    texture->matrix.y0 = 1.0f;
+	}
 	break;
     case GLX_TEXTURE_RECTANGLE_EXT:
 	texture->target = GL_TEXTURE_RECTANGLE_ARB;
 	texture->matrix.xx = 1.0f;
-	texture->matrix.yy = -1.0f;
-	texture->matrix.y0 = height;
+	if (yInverted)
+	{
+	    texture->matrix.yy = 1.0f;
+	}
+	else
+	{
+	    texture->matrix.yy = -1.0f;
+	    texture->matrix.y0 = height;
+	}
 	break;
     default:
 	fprintf (stderr, "%s: pixmap 0x%x can't be bound to texture\n",
 		 programName, (int) pixmap);
 
-	glXDestroyGLXPixmap (screen->display->display, texture->pixmap);
+	destroyGLXPixmap (screen, texture->pixmap);
 	texture->pixmap = None;
 
 	return FALSE;
@@ -211,7 +945,12 @@ bindPixmapToTexture (CompScreen  *screen,
 
     glBindTexture (texture->target, texture->name);
 
-    if (screen->bindTexImageExt)
+    if (screen->useFBConfigs)
+	success = screen->bindTexImageExt (screen->display->display,
+					   texture->pixmap,
+					   TFP_FRONT_LEFT,
+					   NULL);
+    else if (screen->bindTexImageExt)
         success = screen->bindTexImageExt(screen->display->display,
                                           texture->pixmap,
                                           GLX_FRONT_LEFT_EXT,
@@ -225,13 +964,15 @@ bindPixmapToTexture (CompScreen  *screen,
     {
 	fprintf (stderr, "%s: glXBindTexImage failed\n", programName);
 
-	glXDestroyGLXPixmap (screen->display->display, texture->pixmap);
+	destroyGLXPixmap (screen, texture->pixmap);
 	texture->pixmap = None;
 
 	return FALSE;
     }
 
     texture->filter = COMP_TEXTURE_FILTER_FAST;
+    texture->width  = width;
+    texture->height = height;
 
     glTexParameteri (texture->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri (texture->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -248,6 +989,22 @@ void
 releasePixmapFromTexture (CompScreen  *screen,
 			  CompTexture *texture)
 {
+    releaseTextureMipmap (screen, texture);
+
+    if (texture->damage)
+    {
+	if (texture->shmInfo.shmaddr)
+	{
+	    XShmDetach (screen->display->display, &texture->shmInfo);
+	    shmdt (texture->shmInfo.shmaddr);
+	    texture->shmInfo.shmaddr = NULL;
+	}
+
+	XDestroyRegion (texture->damage);
+	texture->damage = NULL;
+	texture->pixmap = None;
+    }
+
     if (texture->pixmap)
     {
 	glEnable (texture->target);
@@ -255,25 +1012,130 @@ releasePixmapFromTexture (CompScreen  *screen,
 
 	screen->releaseTexImage (screen->display->display,
 				 texture->pixmap,
-				 GLX_FRONT_LEFT_EXT);
+				 screen->useFBConfigs ?
+				 TFP_FRONT_LEFT : GLX_FRONT_LEFT_EXT);
 
 	glBindTexture (texture->target, 0);
 	glDisable (texture->target);
 
-	glXDestroyGLXPixmap (screen->display->display, texture->pixmap);
+	destroyGLXPixmap (screen, texture->pixmap);
 	texture->pixmap = None;
     }
 }
 
+void
+releaseTextureMipmap (CompScreen  *screen,
+		      CompTexture *texture)
+{
+    if (texture->mipmap)
+    {
+	glDeleteTextures (1, &texture->mipmap);
+	texture->mipmap = 0;
+    }
+}
+
+/* copies the texture into a separate 2D texture through a framebuffer
+   object and generates mipmaps for it, the copy is only updated when
+   the texture has been damaged since the last time */
+static Bool
+updateTextureMipmap (CompScreen  *screen,
+		     CompTexture *texture)
+{
+    GLenum status;
+
+    if (!texture->mipmap)
+    {
+	glGenTextures (1, &texture->mipmap);
+
+	glBindTexture (GL_TEXTURE_2D, texture->mipmap);
+
+	glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA,
+		      texture->width, texture->height, 0,
+		      GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+			 GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glBindTexture (GL_TEXTURE_2D, 0);
+
+	texture->mipmapDamaged = TRUE;
+    }
+
+    if (!texture->mipmapDamaged)
+	return TRUE;
+
+    if (!screen->mipmapFbo)
+	(*screen->genFramebuffers) (1, &screen->mipmapFbo);
+
+    (*screen->bindFramebuffer) (GL_FRAMEBUFFER_EXT, screen->mipmapFbo);
+    (*screen->framebufferTexture2D) (GL_FRAMEBUFFER_EXT,
+				     GL_COLOR_ATTACHMENT0_EXT,
+				     texture->target, texture->name, 0);
+
+    status = (*screen->checkFramebufferStatus) (GL_FRAMEBUFFER_EXT);
+    if (status == GL_FRAMEBUFFER_COMPLETE_EXT)
+    {
+	glBindTexture (GL_TEXTURE_2D, texture->mipmap);
+	glCopyTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, 0, 0,
+			     texture->width, texture->height);
+	(*screen->generateMipmap) (GL_TEXTURE_2D);
+	glBindTexture (GL_TEXTURE_2D, 0);
+
+	texture->mipmapDamaged = FALSE;
+    }
+
+    (*screen->framebufferTexture2D) (GL_FRAMEBUFFER_EXT,
+				     GL_COLOR_ATTACHMENT0_EXT,
+				     texture->target, 0, 0);
+    (*screen->bindFramebuffer) (GL_FRAMEBUFFER_EXT, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
+    {
+	releaseTextureMipmap (screen, texture);
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
 void
 enableTexture (CompScreen	 *screen,
 	       CompTexture	 *texture,
 	       CompTextureFilter filter)
 {
+    CompTextureFilter *current = &texture->filter;
+
+    if (filter == COMP_TEXTURE_FILTER_BEST)
+    {
+	if (screen->display->textureMipmap	&&
+	    screen->fbo				&&
+	    texture->target == GL_TEXTURE_2D	&&
+	    texture->width && texture->height	&&
+	    !texture->image			&&
+	    updateTextureMipmap (screen, texture))
+	{
+	    glEnable (GL_TEXTURE_2D);
+	    glBindTexture (GL_TEXTURE_2D, texture->mipmap);
+	    return;
+	}
+
+	releaseTextureMipmap (screen, texture);
+
+	filter = COMP_TEXTURE_FILTER_GOOD;
+    }
+
+    /* filter state belongs to the texture object */
+    if (texture->image)
+	current = &texture->image->filter;
+
     glEnable (texture->target);
     glBindTexture (texture->target, texture->name);
 
-    if (filter != texture->filter)
+    if (filter != *current)
     {
 	switch (filter) {
 	case COMP_TEXTURE_FILTER_FAST:
@@ -292,9 +1154,11 @@ enableTexture (CompScreen	 *screen,
 			     GL_TEXTURE_MAG_FILTER,
 			     screen->display->textureFilter);
 	    break;
+	default:
+	    break;
 	}
 
-	texture->filter = filter;
+	*current = filter;
     }
 }
 
@@ -31,24 +31,134 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include <comp.h>
 
+#define WINDOW_SLAB_SIZE 32
+
+/* strictest alignment needed by window privates */
+#define WINDOW_ALIGN(size) (((size) + 15) & ~15)
+
+struct _CompWindowSlab {
+    CompWindowSlab *next;
+    CompWindow	   *freeWindows;
+    int		   nFree;
+
+    /* size of the private block stored after each window */
+    int		   privateSize;
+    int		   windowSize;
+};
+
+#define SLAB_WINDOW(slab, i)					    \
+    ((CompWindow *) ((char *) (slab) +				    \
+		     WINDOW_ALIGN (sizeof (CompWindowSlab)) +	    \
+		     (i) * (slab)->windowSize))
+
+#define WINDOW_PRIVATE_STORAGE(w)			      \
+    ((char *) (w) + WINDOW_ALIGN (sizeof (CompWindow)))
+
+static Bool
+growWindowPrivates (CompWindow *w,
+		    int	       size)
+{
+    void *privates;
+
+    if (size <= WINDOW_INLINE_PRIVATES)
+	return TRUE;
+
+    if (w->privates == w->privateStorage)
+    {
+	privates = malloc (size * sizeof (CompPrivate));
+	if (!privates)
+	    return FALSE;
+
+	memcpy (privates, w->privateStorage, sizeof (w->privateStorage));
+    }
+    else
+    {
+	privates = realloc (w->privates, size * sizeof (CompPrivate));
+	if (!privates)
+	    return FALSE;
+    }
+
+    w->privates = (CompPrivate *) privates;
+
+    return TRUE;
+}
+
+static Bool
+growWindowPrivateBlock (CompWindow *w,
+			int	   size)
+{
+    char *block;
+
+    if (size <= w->privateBlockSize)
+	return TRUE;
+
+    if (w->privateBlock == WINDOW_PRIVATE_STORAGE (w))
+    {
+	block = malloc (size);
+	if (!block)
+	    return FALSE;
+
+	memcpy (block, w->privateBlock, w->privateBlockSize);
+    }
+    else
+    {
+	block = realloc (w->privateBlock, size);
+	if (!block)
+	    return FALSE;
+    }
+
+    memset (block + w->privateBlockSize, 0, size - w->privateBlockSize);
+
+    w->privateBlock     = block;
+    w->privateBlockSize = size;
+
+    return TRUE;
+}
+
+static void
+setWindowPrivateBlock (CompWindow *w)
+{
+    CompScreen *s = w->screen;
+    int	       i;
+
+    for (i = 0; i < s->windowPrivateLen; i++)
+    {
+	if (s->windowPrivateSizes[i])
+	    w->privates[i].ptr = w->privateBlock + s->windowPrivateOffsets[i];
+    }
+}
+
 static int
 reallocWindowPrivates (int  size,
 		       void *closure)
 {
     CompScreen *s = (CompScreen *) closure;
     CompWindow *w;
-    void       *privates;
+    int	       *sizes, *offsets;
+
+    sizes = realloc (s->windowPrivateSizes, size * sizeof (int));
+    if (!sizes)
+	return FALSE;
+
+    s->windowPrivateSizes = sizes;
+
+    offsets = realloc (s->windowPrivateOffsets, size * sizeof (int));
+    if (!offsets)
+	return FALSE;
+
+    s->windowPrivateOffsets = offsets;
+
+    sizes[size - 1]   = 0;
+    offsets[size - 1] = 0;
 
     for (w = s->windows; w; w = w->next)
     {
-	privates = realloc (w->privates, size * sizeof (CompPrivate));
-	if (!privates)
+	if (!growWindowPrivates (w, size))
 	    return FALSE;
-
-	w->privates = (CompPrivate *) privates;
     }
 
     return TRUE;
@@ -63,10 +173,48 @@ allocateWindowPrivateIndex (CompScreen *screen)
 				 (void *) screen);
 }
 
+/* sized privates are appended to the block, the space of a freed
+   index is not reused. Startup plugins allocate their indices before
+   any window exists so their privates end up inline in the slab. */
+int
+allocateSizedWindowPrivateIndex (CompScreen *screen,
+				 int	    size)
+{
+    CompWindow *w;
+    int	       index, blockSize;
+
+    index = allocateWindowPrivateIndex (screen);
+    if (index < 0 || size <= 0)
+	return index;
+
+    blockSize = screen->windowPrivateBlockSize + WINDOW_ALIGN (size);
+
+    for (w = screen->windows; w; w = w->next)
+    {
+	if (!growWindowPrivateBlock (w, blockSize))
+	{
+	    freeWindowPrivateIndex (screen, index);
+	    return -1;
+	}
+    }
+
+    screen->windowPrivateSizes[index]   = size;
+    screen->windowPrivateOffsets[index] = screen->windowPrivateBlockSize;
+    screen->windowPrivateBlockSize	= blockSize;
+
+    for (w = screen->windows; w; w = w->next)
+	setWindowPrivateBlock (w);
+
+    return index;
+}
+
 void
 freeWindowPrivateIndex (CompScreen *screen,
 			int	   index)
 {
+    if (index < screen->windowPrivateLen)
+	screen->windowPrivateSizes[index] = 0;
+
     freePrivateIndex (screen->windowPrivateLen,
 		      screen->windowPrivateIndices,
 		      index);
@@ -224,10 +372,42 @@ static void
 setWindowMatrix (CompWindow *w)
 {
     w->matrix = w->texture.matrix;
+
+    if (w->texture.width && w->texture.width != w->width)
+	w->matrix.xx *= (GLfloat) w->texture.width / w->width;
+
+    if (w->texture.height && w->texture.height != w->height)
+	w->matrix.yy *= (GLfloat) w->texture.height / w->height;
+
     w->matrix.x0 -= (w->attrib.x * w->matrix.xx);
     w->matrix.y0 -= (w->attrib.y * w->matrix.yy);
 }
 
+/* a mipmapped copy of the texture is a separate texture object, its
+   base level and the smaller levels add another 4/3 of the size */
+void
+updateWindowTextureMemory (CompWindow *w)
+{
+    CompScreen    *s = w->screen;
+    unsigned long size = 0;
+
+    if (w->pixmap)
+    {
+	size = (unsigned long) w->width * w->height * 4;
+
+	if (w->texture.mipmap)
+	    size += size * 4 / 3;
+    }
+
+    s->textureMemory -= w->textureMemory;
+    s->textureMemory += size;
+
+    w->textureMemory = size;
+
+    s->opt[COMP_SCREEN_OPTION_TEXTURE_MEMORY].value.i =
+	s->textureMemory / 1024;
+}
+
 void
 bindWindow (CompWindow *w)
 {
@@ -248,15 +428,26 @@ bindWindow (CompWindow *w)
     }
     else
     {
-	w->pixmap = XCompositeNameWindowPixmap (w->screen->display->display,
-						w->id);
-	if (!w->pixmap)
+	Pixmap pixmap;
+
+	pixmap = XCompositeNameWindowPixmap (w->screen->display->display,
+					     w->id);
+	if (!pixmap)
 	{
 	    fprintf (stderr, "%s: XCompositeNameWindowPixmap failed\n",
 		     programName);
 	    return;
 	}
 
+	/* rebinding after a resize, the texture object is kept */
+	if (w->pixmap)
+	{
+	    releasePixmapFromTexture (w->screen, &w->texture);
+	    XFreePixmap (w->screen->display->display, w->pixmap);
+	}
+
+	w->pixmap = pixmap;
+
 	if (!bindPixmapToTexture (w->screen, &w->texture, w->pixmap,
 				  w->width, w->height,
 				  w->attrib.depth))
@@ -266,6 +457,12 @@ bindWindow (CompWindow *w)
 	}
     }
 
+    updateWindowTextureMemory (w);
+
+    w->lastPaint     = w->screen->frameCount;
+    w->resized       = FALSE;
+    w->resizeDamaged = FALSE;
+
     setWindowMatrix (w);
 }
 
@@ -280,31 +477,281 @@ releaseWindow (CompWindow *w)
 	    XFreePixmap (w->screen->display->display, w->pixmap);
 
 	w->pixmap = None;
+
+	updateWindowTextureMemory (w);
+    }
+
+    w->resized       = FALSE;
+    w->resizeDamaged = FALSE;
+}
+
+static int
+compareLastPaint (const void *elem1,
+		  const void *elem2)
+{
+    CompWindow *w1 = *((CompWindow **) elem1);
+    CompWindow *w2 = *((CompWindow **) elem2);
+
+    /* frame counts wrap around */
+    return (int) (w1->lastPaint - w2->lastPaint);
+}
+
+/* release the least recently painted windows until texture memory use
+   is within the limit, windows painted in the last frame are kept */
+void
+evictWindowTextures (CompScreen *s)
+{
+    static CompWindow **lru = NULL;
+    static int	      lruSize = 0;
+    static Region     visible = NULL, tmp = NULL;
+    CompWindow	      *w;
+    unsigned long     limit;
+    int		      i, n = 0;
+
+    limit = s->opt[COMP_SCREEN_OPTION_TEXTURE_MEMORY_LIMIT].value.i;
+    if (!limit)
+	return;
+
+    /* a limit that doesn't fit in bytes can't be reached */
+    if (limit > ULONG_MAX / (1024 * 1024))
+	return;
+
+    limit *= 1024 * 1024;
+
+    if (s->textureMemory <= limit)
+	return;
+
+    if (!visible)
+    {
+	visible = XCreateRegion ();
+	tmp	= XCreateRegion ();
+	if (!visible || !tmp)
+	    return;
+    }
+
+    if (s->nMapped > lruSize)
+    {
+	CompWindow **windows;
+
+	windows = realloc (lru, sizeof (CompWindow *) * s->nMapped);
+	if (!windows)
+	    return;
+
+	lru	= windows;
+	lruSize = s->nMapped;
+    }
+
+    /* windows that show on screen are needed by the next full paint,
+       partial repaints don't paint them so their visibility comes from
+       the stacking order */
+    XUnionRegion (&s->region, &emptyRegion, visible);
+
+    for (i = s->nMapped - 1; i >= 0 && REGION_NOT_EMPTY (visible); i--)
+    {
+	w = s->mapped[i];
+
+	if (w->destroyed || w->invisible)
+	    continue;
+
+	XIntersectRegion (w->region, visible, tmp);
+	if (REGION_NOT_EMPTY (tmp))
+	    w->lastPaint = s->frameCount;
+
+	XSubtractRegion (visible, w->alpha ? w->opaque : w->region, visible);
+    }
+
+    for (i = 0; i < s->nMapped; i++)
+    {
+	w = s->mapped[i];
+
+	if (w->pixmap && w->lastPaint != s->frameCount)
+	    lru[n++] = w;
+    }
+
+    qsort (lru, n, sizeof (CompWindow *), compareLastPaint);
+
+    for (i = 0; i < n && s->textureMemory > limit; i++)
+	releaseWindow (lru[i]);
+}
+
+/* bind windows that have been mapped since the last redraw so that
+   the next frame doesn't have to wait for it */
+void
+prebindWindows (CompScreen *s)
+{
+    CompWindow *w;
+    int	       i;
+
+    if (!s->pendingBinds)
+	return;
+
+    s->pendingBinds = FALSE;
+
+    if (!s->opt[COMP_SCREEN_OPTION_PREBIND_WINDOWS].value.b)
+	return;
+
+    for (i = 0; i < s->nMapped; i++)
+    {
+	w = s->mapped[i];
+
+	if (w->pixmap || w->destroyed || w->invisible)
+	    continue;
+
+	bindWindow (w);
+    }
+}
+
+/* windows are carved out of per-screen slabs and returned to their
+   slab when destroyed. A free window keeps its regions and vertex and
+   index buffers so they can be reused by the next window that takes
+   its place, everything else is poisoned so a stale pointer to it
+   doesn't look like a live window. Each window is followed by the
+   private block of the sized window privates. */
+static CompWindowSlab *
+allocWindowSlab (CompScreen *s)
+{
+    CompWindowSlab *slab;
+    CompWindow	   *w, **stack, **mapped;
+    int		   i, size, windowSize;
+
+    size = s->stackSize + WINDOW_SLAB_SIZE;
+
+    stack = realloc (s->stack, sizeof (CompWindow *) * size);
+    if (!stack)
+	return NULL;
+
+    s->stack = stack;
+
+    mapped = realloc (s->mapped, sizeof (CompWindow *) * size);
+    if (!mapped)
+	return NULL;
+
+    s->mapped = mapped;
+
+    windowSize = WINDOW_ALIGN (sizeof (CompWindow)) +
+	s->windowPrivateBlockSize;
+
+    slab = malloc (WINDOW_ALIGN (sizeof (CompWindowSlab)) +
+		   windowSize * WINDOW_SLAB_SIZE);
+    if (!slab)
+	return NULL;
+
+    s->stackSize = size;
+
+    slab->freeWindows = NULL;
+    slab->nFree	      = WINDOW_SLAB_SIZE;
+    slab->privateSize = s->windowPrivateBlockSize;
+    slab->windowSize  = windowSize;
+
+    for (i = 0; i < WINDOW_SLAB_SIZE; i++)
+    {
+	w = SLAB_WINDOW (slab, i);
+
+	w->region     = NULL;
+	w->clip       = NULL;
+	w->opaque     = NULL;
+	w->vertices   = 0;
+	w->vertexSize = 0;
+	w->slab	      = slab;
+
+	w->next = slab->freeWindows;
+	slab->freeWindows = w;
+    }
+
+    slab->next = s->windowSlabs;
+    s->windowSlabs = slab;
+
+    return slab;
+}
+
+static void
+freeWindowSlab (CompScreen     *s,
+		CompWindowSlab *slab)
+{
+    CompWindowSlab **p;
+    CompWindow	   *w;
+    int		   i;
+
+    for (p = &s->windowSlabs; *p; p = &(*p)->next)
+    {
+	if (*p == slab)
+	{
+	    *p = slab->next;
+	    break;
+	}
+    }
+
+    for (i = 0; i < WINDOW_SLAB_SIZE; i++)
+    {
+	w = SLAB_WINDOW (slab, i);
+
+	if (w->region)
+	    XDestroyRegion (w->region);
+
+	if (w->clip)
+	    XDestroyRegion (w->clip);
+
+	if (w->opaque)
+	    XDestroyRegion (w->opaque);
+
+	if (w->vertices)
+	    free (w->vertices);
+    }
+
+    s->stackSize -= WINDOW_SLAB_SIZE;
+
+    free (slab);
+}
+
+static CompWindow *
+allocWindow (CompScreen *s)
+{
+    CompWindowSlab *slab;
+    CompWindow	   *w;
+
+    /* slabs made before a plugin added sized privates are only used
+       until they are empty */
+    for (slab = s->windowSlabs; slab; slab = slab->next)
+    {
+	if (slab->nFree && slab->privateSize >= s->windowPrivateBlockSize)
+	    break;
     }
+
+    if (!slab)
+    {
+	slab = allocWindowSlab (s);
+	if (!slab)
+	    return NULL;
+    }
+
+    w = slab->freeWindows;
+    slab->freeWindows = w->next;
+    slab->nFree--;
+
+    w->privates		= w->privateStorage;
+    w->privateBlock	= WINDOW_PRIVATE_STORAGE (w);
+    w->privateBlockSize = slab->privateSize;
+
+    return w;
 }
 
 static void
 freeWindow (CompWindow *w)
 {
+    CompScreen	   *s = w->screen;
+    CompWindowSlab *slab = w->slab, *other;
+    CompWindow	   keep;
+
     releaseWindow (w);
 
     if (w->texture.name)
 	finiTexture (w->screen, &w->texture);
 
-    if (w->clip)
-	XDestroyRegion (w->clip);
-
-    if (w->region)
-	XDestroyRegion (w->region);
-
-    if (w->privates)
+    if (w->privates != w->privateStorage)
 	free (w->privates);
 
-    if (w->vertices)
-	free (w->vertices);
-
-    if (w->indices)
-	free (w->indices);
+    if (w->privateBlock != WINDOW_PRIVATE_STORAGE (w))
+	free (w->privateBlock);
 
     if (lastFoundWindow == w)
 	lastFoundWindow = 0;
@@ -312,7 +759,35 @@ freeWindow (CompWindow *w)
     if (lastDamagedWindow == w)
 	lastDamagedWindow = 0;
 
-    free (w);
+    keep = *w;
+
+    memset (w, 0xa5, sizeof (CompWindow));
+
+    w->region     = keep.region;
+    w->clip	  = keep.clip;
+    w->opaque     = keep.opaque;
+    w->vertices   = keep.vertices;
+    w->vertexSize = keep.vertexSize;
+    w->slab	  = slab;
+
+    w->next = slab->freeWindows;
+    slab->freeWindows = w;
+    slab->nFree++;
+
+    /* an empty slab is returned unless it's the only one with room,
+       so windows that come and go don't allocate a slab every time */
+    if (slab->nFree == WINDOW_SLAB_SIZE)
+    {
+	for (other = s->windowSlabs; other; other = other->next)
+	{
+	    if (other != slab && other->nFree &&
+		other->privateSize >= s->windowPrivateBlockSize)
+		break;
+	}
+
+	if (other || slab->privateSize < s->windowPrivateBlockSize)
+	    freeWindowSlab (s, slab);
+    }
 }
 
 Bool
@@ -390,6 +865,69 @@ updateWindowRegion (CompWindow *w)
 
     if (shapeRects)
 	XFree (shapeRects);
+
+    updateWindowOpaqueRegion (w);
+}
+
+/* windows with an alpha channel can tell which part of them is opaque
+   so that it can be painted in the solid pass and occlude what's below */
+void
+updateWindowOpaqueRegion (CompWindow *w)
+{
+    Atom	  actual;
+    int		  result, format;
+    unsigned long n, left;
+    unsigned long *data;
+    REGION	  rect;
+    Window	  child;
+    int		  i, x = 0, y = 0;
+
+    EMPTY_REGION (w->opaque);
+
+    if (!w->alpha)
+	return;
+
+    /* toolkits set the region on the client window, its rectangles are
+       relative to where the client sits inside the frame */
+    if (w->client != w->id)
+    {
+	if (!XTranslateCoordinates (w->screen->display->display, w->client,
+				    w->id, 0, 0, &x, &y, &child))
+	    return;
+    }
+
+    result = XGetWindowProperty (w->screen->display->display, w->client,
+				 w->screen->display->winOpaqueRegionAtom,
+				 0L, 4096L, FALSE, XA_CARDINAL, &actual,
+				 &format, &n, &left,
+				 (unsigned char **) &data);
+
+    if (result != Success || !n || actual != XA_CARDINAL || format != 32)
+    {
+	if (result == Success && data)
+	    XFree (data);
+
+	return;
+    }
+
+    rect.rects = &rect.extents;
+    rect.numRects = rect.size = 1;
+
+    /* rectangles are relative to the inside of the window border */
+    for (i = 0; i + 3 < n; i += 4)
+    {
+	rect.extents.x1 = w->attrib.x + w->attrib.border_width + x + data[i];
+	rect.extents.y1 = w->attrib.y + w->attrib.border_width + y +
+	    data[i + 1];
+	rect.extents.x2 = rect.extents.x1 + data[i + 2];
+	rect.extents.y2 = rect.extents.y1 + data[i + 3];
+
+	XUnionRegion (&rect, w->opaque, w->opaque);
+    }
+
+    XFree (data);
+
+    XIntersectRegion (w->opaque, w->region, w->opaque);
 }
 
 void
@@ -399,7 +937,7 @@ addWindow (CompScreen *screen,
 {
     CompWindow *w;
 
-    w = (CompWindow *) malloc (sizeof (CompWindow));
+    w = allocWindow (screen);
     if (!w)
 	return;
 
@@ -411,37 +949,57 @@ addWindow (CompScreen *screen,
     w->pixmap       = None;
     w->destroyed    = FALSE;
     w->damaged      = FALSE;
+    w->nextDestroy  = NULL;
+
+    w->pluginsInitialized = FALSE;
+
+    w->textureMemory = 0;
+    w->lastPaint     = 0;
+    w->resized       = FALSE;
+    w->resizeDamaged = FALSE;
 
-    w->vertices   = 0;
-    w->vertexSize = 0;
-    w->indices    = 0;
-    w->indexSize  = 0;
-    w->vCount     = 0;
+    w->vCount = 0;
 
-    if (screen->windowPrivateLen)
+    w->deformed = FALSE;
+
+    if (!growWindowPrivates (w, screen->windowPrivateLen) ||
+	!growWindowPrivateBlock (w, screen->windowPrivateBlockSize))
     {
-	w->privates = malloc (screen->windowPrivateLen * sizeof (CompPrivate));
-	if (!w->privates)
+	freeWindow (w);
+	return;
+    }
+
+    memset (w->privateBlock, 0, screen->windowPrivateBlockSize);
+    setWindowPrivateBlock (w);
+
+    if (!w->region)
+    {
+	w->region = XCreateRegion ();
+	if (!w->region)
 	{
-	    free (w);
+	    freeWindow (w);
 	    return;
 	}
     }
-    else
-	w->privates = 0;
 
-    w->region = XCreateRegion ();
-    if (!w->region)
+    if (!w->clip)
     {
-	freeWindow (w);
-	return;
+	w->clip = XCreateRegion ();
+	if (!w->clip)
+	{
+	    freeWindow (w);
+	    return;
+	}
     }
 
-    w->clip = XCreateRegion ();
-    if (!w->clip)
+    if (!w->opaque)
     {
-	freeWindow (w);
-	return;
+	w->opaque = XCreateRegion ();
+	if (!w->opaque)
+	{
+	    freeWindow (w);
+	    return;
+	}
     }
 
     if (!XGetWindowAttributes (screen->display->display, id, &w->attrib))
@@ -455,6 +1013,10 @@ addWindow (CompScreen *screen,
     w->id      = id;
     w->client  = clientWindow (screen->display, id);
     w->alpha   = (w->attrib.depth == 32);
+
+    if (w->client != id)
+	XSelectInput (screen->display->display, w->client,
+		      PropertyChangeMask);
     w->opacity = OPAQUE;
     w->type    = getWindowType (screen->display, w->client);
 
@@ -466,20 +1028,12 @@ addWindow (CompScreen *screen,
 
     updateWindowRegion (w);
 
-    insertWindowIntoScreen (screen, w, aboveId);
+    w->damage = None;
 
     if (w->attrib.class != InputOnly)
-    {
 	initTexture (screen, &w->texture);
-
-	w->damage = XDamageCreate (screen->display->display, id,
-				   XDamageReportRawRectangles);
-    }
     else
-    {
-	w->damage = None;
 	w->attrib.map_state = IsUnmapped;
-    }
 
     if (testMode)
     {
@@ -487,17 +1041,42 @@ addWindow (CompScreen *screen,
 	bindWindow (w);
     }
 
+    /* damage is only tracked while the window is mapped */
+    if (w->attrib.map_state == IsViewable)
+	w->damage = XDamageCreate (screen->display->display, id,
+				   XDamageReportRawRectangles);
+
+    insertWindowIntoScreen (screen, w, aboveId);
+
     w->invisible = TRUE;
 
     if (w->type == w->screen->display->winDesktopAtom)
 	w->screen->desktopWindowCount++;
 
-    windowInitPlugins (w);
+    /* plugin window state is created when the window is first mapped */
+    if (w->attrib.map_state == IsViewable)
+	windowInitPlugins (w);
 }
 
 void
 removeWindow (CompWindow *w)
 {
+    if (w->destroyed)
+    {
+	CompWindow **p;
+
+	/* windows are removed from the head of the queue so this
+	   is only a real search when a window goes away early */
+	for (p = &w->screen->pendingDestroys; *p; p = &(*p)->nextDestroy)
+	{
+	    if (*p == w)
+	    {
+		*p = w->nextDestroy;
+		break;
+	    }
+	}
+    }
+
     if (w->attrib.map_state == IsViewable)
     {
 	if (w->type == w->screen->display->winDesktopAtom)
@@ -515,7 +1094,9 @@ destroyWindow (CompWindow *w)
     if (!w->destroyed)
     {
 	w->destroyed = TRUE;
-	w->screen->pendingDestroys++;
+
+	w->nextDestroy = w->screen->pendingDestroys;
+	w->screen->pendingDestroys = w;
     }
 }
 
@@ -532,8 +1113,32 @@ mapWindow (CompWindow *w)
 	w->screen->desktopWindowCount++;
 
     w->attrib.map_state = IsViewable;
+
+    /* a frame is usually created before its client is reparented into
+       it, by the time the frame is mapped the client can be found */
+    if (w->alpha && w->client == w->id)
+    {
+	w->client = clientWindow (w->screen->display, w->id);
+	if (w->client != w->id)
+	{
+	    XSelectInput (w->screen->display->display, w->client,
+			  PropertyChangeMask);
+
+	    updateWindowOpaqueRegion (w);
+	}
+    }
+
+    insertMappedWindow (w->screen, w);
+
+    windowInitPlugins (w);
+
+    w->damage = XDamageCreate (w->screen->display->display, w->id,
+			       XDamageReportRawRectangles);
+
+    /* the window is shown once the client has drawn it, the first
+       damage event marks it damaged and runs the map effects */
     w->invisible = TRUE;
-    w->damaged = FALSE;
+    w->damaged   = FALSE;
 }
 
 void
@@ -550,6 +1155,14 @@ unmapWindow (CompWindow *w)
     w->attrib.map_state = IsUnmapped;
     w->invisible = TRUE;
 
+    w->screen->pendingUnmaps = TRUE;
+
+    if (w->damage)
+    {
+	XDamageDestroy (w->screen->display->display, w->damage);
+	w->damage = None;
+    }
+
     releaseWindow (w);
 }
 
@@ -592,7 +1205,12 @@ configureWindow (CompWindow	 *w,
 	w->width  = w->attrib.width  + w->attrib.border_width * 2;
 	w->height = w->attrib.height + w->attrib.border_width * 2;
 
-	releaseWindow (w);
+	/* the old pixmap is kept until the window has been redrawn so
+	   that several configure events only cause a single rebind */
+	if (w->pixmap)
+	    w->resized = TRUE;
+
+	setWindowMatrix (w);
 
 	EMPTY_REGION (w->region);
 
@@ -603,6 +1221,7 @@ configureWindow (CompWindow	 *w,
 	addWindowDamage (w);
 
 	XOffsetRegion (w->region, ce->x - w->attrib.x, ce->y - w->attrib.y);
+	XOffsetRegion (w->opaque, ce->x - w->attrib.x, ce->y - w->attrib.y);
 
 	w->attrib.x = ce->x;
 	w->attrib.y = ce->y;
@@ -651,6 +1270,7 @@ invisibleWindowMove (CompWindow *w,
     w->attrib.y += dy;
 
     XOffsetRegion (w->region, dx, dy);
+    XOffsetRegion (w->opaque, dx, dy);
 
     setWindowMatrix (w);
 }
@@ -0,0 +1,250 @@
+/*
+ * Copyright © 2005 Novell, Inc.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * and its documentation for any purpose is hereby granted without
+ * fee, provided that the above copyright notice appear in all copies
+ * and that both that copyright notice and this permission notice
+ * appear in supporting documentation, and that the name of
+ * Novell, Inc. not be used in advertising or publicity pertaining to
+ * distribution of the software without specific, written prior permission.
+ * Novell, Inc. makes no representations about the suitability of this
+ * software for any purpose. It is provided "as is" without express or
+ * implied warranty.
+ *
+ * NOVELL, INC. DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN
+ * NO EVENT SHALL NOVELL, INC. BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION
+ * WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * Author: David Reveman <davidr@novell.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <comp.h>
+
+/* Work procs run one at a time on a single background thread. When a
+   work proc returns the job is moved to the finished list and a byte
+   is written to the wakeup pipe so the event loop leaves poll and
+   calls the done proc from the main thread. */
+
+typedef struct _CompWork {
+    struct _CompWork *next;
+    WorkProc	     work;
+    WorkProc	     done;
+    void	     *closure;
+    CompWorkHandle   handle;
+} CompWork;
+
+static pthread_mutex_t workMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  workCond  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  doneCond  = PTHREAD_COND_INITIALIZER;
+
+static CompWork       *pendingWork  = 0;
+static CompWork       *runningWork  = 0;
+static CompWork       *finishedWork = 0;
+static CompWorkHandle lastWorkHandle = 1;
+
+static int  wakeupPipe[2] = { -1, -1 };
+static Bool workerRunning = FALSE;
+
+static void
+appendWork (CompWork **list,
+	    CompWork *work)
+{
+    while (*list)
+	list = &(*list)->next;
+
+    work->next = 0;
+    *list = work;
+}
+
+static Bool
+unlinkWork (CompWork	   **list,
+	    CompWorkHandle handle)
+{
+    CompWork *w;
+
+    for (; *list; list = &(*list)->next)
+    {
+	if ((*list)->handle == handle)
+	{
+	    w = *list;
+	    *list = w->next;
+	    free (w);
+
+	    return TRUE;
+	}
+    }
+
+    return FALSE;
+}
+
+static void *
+workerThread (void *arg)
+{
+    CompWork *w;
+    char     c = 0;
+
+    pthread_mutex_lock (&workMutex);
+
+    for (;;)
+    {
+	while (!pendingWork)
+	    pthread_cond_wait (&workCond, &workMutex);
+
+	w = pendingWork;
+	pendingWork = w->next;
+	runningWork = w;
+
+	pthread_mutex_unlock (&workMutex);
+
+	(*w->work) (w->closure);
+
+	pthread_mutex_lock (&workMutex);
+
+	runningWork = 0;
+	appendWork (&finishedWork, w);
+
+	pthread_cond_broadcast (&doneCond);
+
+	/* the pipe is non-blocking, a full pipe already wakes the
+	   event loop */
+	if (write (wakeupPipe[1], &c, 1) < 0)
+	    c = 0;
+    }
+
+    return NULL;
+}
+
+static Bool
+startWorker (void)
+{
+    pthread_t thread;
+    int	      i;
+
+    if (pipe (wakeupPipe) < 0)
+    {
+	fprintf (stderr, "%s: Couldn't create wakeup pipe\n", programName);
+	return FALSE;
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+	fcntl (wakeupPipe[i], F_SETFL, O_NONBLOCK);
+	fcntl (wakeupPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (pthread_create (&thread, NULL, workerThread, NULL))
+    {
+	fprintf (stderr, "%s: Couldn't create worker thread\n", programName);
+
+	close (wakeupPipe[0]);
+	close (wakeupPipe[1]);
+	wakeupPipe[0] = wakeupPipe[1] = -1;
+
+	return FALSE;
+    }
+
+    pthread_detach (thread);
+
+    workerRunning = TRUE;
+
+    return TRUE;
+}
+
+CompWorkHandle
+compAddWork (WorkProc work,
+	     WorkProc done,
+	     void     *closure)
+{
+    CompWork *w;
+
+    if (!workerRunning && !startWorker ())
+	return 0;
+
+    w = malloc (sizeof (CompWork));
+    if (!w)
+	return 0;
+
+    w->work    = work;
+    w->done    = done;
+    w->closure = closure;
+
+    pthread_mutex_lock (&workMutex);
+
+    w->handle = lastWorkHandle++;
+
+    appendWork (&pendingWork, w);
+    pthread_cond_signal (&workCond);
+
+    pthread_mutex_unlock (&workMutex);
+
+    return w->handle;
+}
+
+/* neither the work proc nor the done proc will be called once this
+   returns so the closure can be freed, waits for the work proc to
+   finish if it's currently running */
+void
+compRemoveWork (CompWorkHandle handle)
+{
+    pthread_mutex_lock (&workMutex);
+
+    if (!unlinkWork (&pendingWork, handle))
+    {
+	while (runningWork && runningWork->handle == handle)
+	    pthread_cond_wait (&doneCond, &workMutex);
+
+	unlinkWork (&finishedWork, handle);
+    }
+
+    pthread_mutex_unlock (&workMutex);
+}
+
+int
+compWorkFd (void)
+{
+    return wakeupPipe[0];
+}
+
+void
+compProcessFinishedWork (void)
+{
+    CompWork *w;
+    char     buf[32];
+
+    if (!workerRunning)
+	return;
+
+    while (read (wakeupPipe[0], buf, sizeof (buf)) > 0);
+
+    /* done procs are allowed to add and remove work so the lock is
+       only held while a job is taken off the list */
+    for (;;)
+    {
+	pthread_mutex_lock (&workMutex);
+
+	w = finishedWork;
+	if (w)
+	    finishedWork = w->next;
+
+	pthread_mutex_unlock (&workMutex);
+
+	if (!w)
+	    break;
+
+	if (w->done)
+	    (*w->done) (w->closure);
+
+	free (w);
+    }
+}